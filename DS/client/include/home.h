@@ -4,6 +4,10 @@
 #include "ui_home.h"
 #include "util.h"
 
+#include <optional>
+
+#include <QJsonObject>
+
 class Mod;
 class New;
 class Eva;
@@ -30,6 +34,9 @@ public:
   void load_info ();
   void load_dish ();
   void load_eval ();
+  bool relogin (QWidget *ctx);
+  std::optional<QJsonObject> post (QString const &url, QJsonObject data,
+				   QWidget *ctx);
 
 private slots:
   void on_pbtn1_clicked ();
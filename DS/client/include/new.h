@@ -4,7 +4,10 @@
 #include "ui_new.h"
 #include "util.h"
 
+#include <QJsonObject>
+
 class Home;
+class DishItem;
 
 class New : public QDialog
 {
@@ -20,6 +23,8 @@ public:
 
 private:
   qint64 get_id ();
+  QList<DishItem *> get_dishes ();
+  bool batch (QString const &url, QList<QJsonObject> const &bodies);
 
 private slots:
   void on_pbtn1_clicked ();
@@ -8,6 +8,8 @@
 #define URL_BASE_MENU URL_BASE "/menu"
 #define URL_BASE_EVA URL_BASE "/eva"
 
+#define URL_BATCH URL_BASE "/batch"
+
 #define URL_STUDENT_NEW URL_BASE_STUDENT "/new"
 #define URL_STUDENT_LOG URL_BASE_STUDENT "/log"
 #define URL_STUDENT_MOD URL_BASE_STUDENT "/mod"
@@ -28,6 +30,8 @@
 #define URL_EVA_MOD URL_BASE_EVA "/mod"
 #define URL_EVA_DEL URL_BASE_EVA "/del"
 
+#define CODE_NO_SESSION 9
+
 enum class type
 {
   STUDENT,
@@ -44,12 +44,8 @@ Eva::on_pbtn2_clicked ()
   auto req_url = QString (URL_EVA_DEL);
 
   req_data["id"] = get_id ();
-  req_data["user"] = parent->info["user"];
-  req_data["pass"] = parent->info["pass"];
 
-  auto http = Http ();
-  auto reply = http.post (req_url, req_data);
-  if (!Http::get_data (reply, this).has_value ())
+  if (!parent->post (req_url, req_data, this).has_value ())
     return;
 
   QMessageBox::information (this, tr ("提示"), tr ("操作成功，返回查看"));
@@ -73,8 +69,6 @@ Eva::on_pbtn3_clicked ()
   auto req_data = QJsonObject ();
 
   req_data["id"] = get_id ();
-  req_data["user"] = parent->info["user"];
-  req_data["pass"] = parent->info["pass"];
 
   switch (op)
     {
@@ -91,9 +85,7 @@ Eva::on_pbtn3_clicked ()
       break;
     }
 
-  auto http = Http ();
-  auto reply = http.post (req_url, req_data);
-  if (!Http::get_data (reply, this).has_value ())
+  if (!parent->post (req_url, req_data, this).has_value ())
     return;
 
   QMessageBox::information (this, tr ("提示"), tr ("操作成功，返回查看"));
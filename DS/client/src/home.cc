@@ -6,6 +6,7 @@
 #include "mod.h"
 #include "new.h"
 
+#include <QInputDialog>
 #include <QJsonArray>
 
 Home::Home (type typ, info_t info)
@@ -20,6 +21,7 @@ Home::Home (type typ, info_t info)
       ui.hint3->setText (tr ("位置: "));
       ui.pbtn5->setText (tr ("添加菜品"));
       ui.pbtn6->setText (tr ("修改菜品"));
+      ui.list->setSelectionMode (QAbstractItemView::ExtendedSelection);
     }
 
   connect (ui.sort, &QCheckBox::toggled, [this] (bool dec) {
@@ -59,6 +61,51 @@ Home::load_info ()
     }
 }
 
+bool
+Home::relogin (QWidget *ctx)
+{
+  auto ok = false;
+  auto pass = QInputDialog::getText (ctx, tr ("登录已失效"),
+				     tr ("请输入密码重新登录"),
+				     QLineEdit::Password, QString (), &ok);
+  if (!ok || pass.isEmpty ())
+    return false;
+
+  auto req_data = QJsonObject ();
+  req_data["user"] = info["user"];
+  req_data["pass"] = pass;
+
+  auto http = Http ();
+  auto reply = http.post (
+      typ == type::STUDENT ? URL_STUDENT_LOG : URL_MERCHANT_LOG, req_data);
+
+  auto res = Http::get_data (reply, ctx);
+  if (!res.has_value ())
+    return false;
+
+  info["token"] = res.value ()["data"].toObject ()["token"].toString ();
+  return true;
+}
+
+std::optional<QJsonObject>
+Home::post (QString const &url, QJsonObject data, QWidget *ctx)
+{
+  data["token"] = info["token"];
+
+  auto http = Http ();
+  auto reply = http.post (url, data);
+
+  auto obj = QJsonDocument::fromJson (reply->peek (reply->bytesAvailable ()))
+		 .object ();
+  if (!reply->error () && obj["code"] == CODE_NO_SESSION && relogin (ctx))
+    {
+      data["token"] = info["token"];
+      reply = http.post (url, data);
+    }
+
+  return Http::get_data (reply, ctx);
+}
+
 void
 Home::load_dish ()
 {
@@ -25,7 +25,8 @@ Mod::Mod (Home *parent) : QDialog (parent)
 int
 Mod::exec ()
 {
-  ui.ledit1->setText (parent->info["pass"]);
+  ui.ledit5->clear ();
+  ui.ledit1->clear ();
   ui.ledit2->setText (parent->info["name"]);
   ui.ledit3->setText (parent->info["number"]);
 
@@ -44,11 +45,17 @@ Mod::on_pbtn1_clicked ()
 void
 Mod::on_pbtn2_clicked ()
 {
+  auto pass = ui.ledit5->text ();
+  if (pass.isEmpty ())
+    {
+      QMessageBox::warning (this, tr ("提示"), tr ("请输入原密码"));
+      return;
+    }
+
   auto req_url = QString ();
   auto req_data = QJsonObject ();
 
-  req_data["user"] = parent->info["user"];
-  req_data["pass"] = parent->info["pass"];
+  req_data["pass"] = pass;
 
   switch (parent->typ)
     {
@@ -61,9 +68,7 @@ Mod::on_pbtn2_clicked ()
       break;
     }
 
-  auto http = Http ();
-  auto reply = http.post (req_url, req_data);
-  if (!Http::get_data (reply, this).has_value ())
+  if (!parent->post (req_url, req_data, this).has_value ())
     return;
 
   QMessageBox::information (this, tr ("提示"), tr ("注销成功"));
@@ -73,6 +78,7 @@ Mod::on_pbtn2_clicked ()
 void
 Mod::on_pbtn3_clicked ()
 {
+  auto pass = ui.ledit5->text ();
   auto npass = ui.ledit1->text ();
   auto nname = ui.ledit2->text ();
   auto nnumber = ui.ledit3->text ();
@@ -80,8 +86,8 @@ Mod::on_pbtn3_clicked ()
 
   auto typ = parent->typ;
 
-  if (npass.isEmpty () || nname.isEmpty () || nnumber.isEmpty ()
-      || (nposition.isEmpty () && typ == type::MERCHANT))
+  if (pass.isEmpty () || npass.isEmpty () || nname.isEmpty ()
+      || nnumber.isEmpty () || (nposition.isEmpty () && typ == type::MERCHANT))
     {
       QMessageBox::warning (this, tr ("提示"), tr ("请完整填写信息"));
       return;
@@ -91,9 +97,7 @@ Mod::on_pbtn3_clicked ()
   auto req_url = QString ();
   auto req_data = QJsonObject ();
 
-  req_data["user"] = info["user"];
-  req_data["pass"] = info["pass"];
-
+  req_data["pass"] = pass;
   req_data["npass"] = npass;
   req_data["nname"] = nname;
   req_data["nnumber"] = nnumber;
@@ -110,12 +114,9 @@ Mod::on_pbtn3_clicked ()
       break;
     }
 
-  auto http = Http ();
-  auto reply = http.post (req_url, req_data);
-  if (!Http::get_data (reply, this).has_value ())
+  if (!parent->post (req_url, req_data, this).has_value ())
     return;
 
-  info["pass"] = std::move (npass);
   info["name"] = std::move (nname);
   info["number"] = std::move (nnumber);
   if (typ == type::MERCHANT)
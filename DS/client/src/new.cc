@@ -4,6 +4,8 @@
 #include "http.h"
 #include "util.h"
 
+#include <QJsonArray>
+
 New::New (Home *parent, oper op) : QDialog (parent), parent (parent), op (op)
 {
   ui.setupUi (this);
@@ -22,6 +24,14 @@ New::New (Home *parent, oper op) : QDialog (parent), parent (parent), op (op)
       setWindowTitle (tr ("修改菜品"));
       ui.pbtn3->setText (tr ("修改"));
       ui.label1->setText (tr ("修改菜品"));
+
+      if (get_dishes ().size () > 1)
+	{
+	  setWindowTitle (tr ("批量修改菜品"));
+	  ui.label1->setText (tr ("批量修改菜品"));
+	  ui.ledit1->setEnabled (false);
+	  ui.ledit1->setPlaceholderText (tr ("保持原名"));
+	}
       break;
     }
 }
@@ -33,6 +43,65 @@ New::get_id ()
   return dynamic_cast<DishItem *> (item)->data.id;
 }
 
+QList<DishItem *>
+New::get_dishes ()
+{
+  auto result = QList<DishItem *> ();
+  for (auto item : parent->ui.list->selectedItems ())
+    result.append (dynamic_cast<DishItem *> (item));
+  return result;
+}
+
+bool
+New::batch (QString const &url, QList<QJsonObject> const &bodies)
+{
+  auto ops = QJsonArray ();
+  for (auto body : bodies)
+    {
+      body["token"] = parent->info["token"];
+
+      auto item = QJsonObject ();
+      item["uri"] = QUrl (url).path ();
+      item["body"] = body;
+      ops.append (item);
+    }
+
+  auto req_data = QJsonObject ();
+  req_data["ops"] = ops;
+
+  auto http = Http ();
+  auto reply = http.post (URL_BATCH, req_data);
+
+  auto res = Http::get_data (reply, this);
+  if (!res.has_value ())
+    return false;
+
+  auto data = res.value ()["data"].toArray ();
+  if (!data.isEmpty () && data[0].toObject ()["code"] == CODE_NO_SESSION
+      && parent->relogin (this))
+    return batch (url, bodies);
+
+  auto fails = 0;
+  auto msg = QString ();
+  for (auto elem : data)
+    {
+      auto obj = elem.toObject ();
+      if (obj["code"] != 0)
+	{
+	  fails++;
+	  msg = obj["data"].toString (tr ("信息丢失"));
+	}
+    }
+
+  if (!fails)
+    return true;
+
+  QMessageBox::warning (this, tr ("失败"),
+			tr ("%1 项操作失败: %2").arg (fails).arg (msg));
+  parent->load_dish ();
+  return false;
+}
+
 void
 New::on_pbtn1_clicked ()
 {
@@ -42,16 +111,32 @@ New::on_pbtn1_clicked ()
 void
 New::on_pbtn2_clicked ()
 {
+  auto dishes = get_dishes ();
+  if (dishes.size () > 1)
+    {
+      auto bodies = QList<QJsonObject> ();
+      for (auto dish : dishes)
+	{
+	  auto body = QJsonObject ();
+	  body["id"] = qint64 (dish->data.id);
+	  bodies.append (body);
+	}
+
+      if (!batch (URL_MENU_DEL, bodies))
+	return;
+
+      QMessageBox::information (this, tr ("提示"), tr ("操作成功，返回查看"));
+      parent->load_dish ();
+      close ();
+      return;
+    }
+
   auto req_data = QJsonObject ();
   auto req_url = QString (URL_MENU_DEL);
 
   req_data["id"] = get_id ();
-  req_data["user"] = parent->info["user"];
-  req_data["pass"] = parent->info["pass"];
 
-  auto http = Http ();
-  auto reply = http.post (req_url, req_data);
-  if (!Http::get_data (reply, this).has_value ())
+  if (!parent->post (req_url, req_data, this).has_value ())
     return;
 
   QMessageBox::information (this, tr ("提示"), tr ("操作成功，返回查看"));
@@ -64,20 +149,40 @@ New::on_pbtn3_clicked ()
 {
   auto name = ui.ledit1->text ();
   auto price_str = ui.ledit2->text ();
+  auto dishes = get_dishes ();
+  auto bulk = op == oper::MOD && dishes.size () > 1;
 
-  if (name.isEmpty () || price_str.isEmpty ())
+  if ((name.isEmpty () && !bulk) || price_str.isEmpty ())
     {
       QMessageBox::warning (this, tr ("提示"), tr ("请完整填写信息"));
       return;
     }
 
+  if (bulk)
+    {
+      auto bodies = QList<QJsonObject> ();
+      for (auto dish : dishes)
+	{
+	  auto body = QJsonObject ();
+	  body["id"] = qint64 (dish->data.id);
+	  body["nname"] = dish->data.name;
+	  body["nprice"] = price_str.toDouble ();
+	  bodies.append (body);
+	}
+
+      if (!batch (URL_MENU_MOD, bodies))
+	return;
+
+      QMessageBox::information (this, tr ("提示"), tr ("操作成功，返回查看"));
+      parent->load_dish ();
+      close ();
+      return;
+    }
+
   auto req_url = QString ();
   auto req_data = QJsonObject ();
   auto price = price_str.toDouble ();
 
-  req_data["user"] = parent->info["user"];
-  req_data["pass"] = parent->info["pass"];
-
   switch (op)
     {
     case oper::NEW:
@@ -94,9 +199,7 @@ New::on_pbtn3_clicked ()
       break;
     }
 
-  auto http = Http ();
-  auto reply = http.post (req_url, req_data);
-  if (!Http::get_data (reply, this).has_value ())
+  if (!parent->post (req_url, req_data, this).has_value ())
     return;
 
   QMessageBox::information (this, tr ("提示"), tr ("操作成功，返回查看"));
@@ -1,53 +1,93 @@
 #include "api.h"
+#include "cache.h"
+#include "log.h"
+#include "json.h"
 #include "mongoose.h"
+#include "session.h"
 #include "table.h"
+#include "util.h"
+#include "view.h"
 
-#include <jansson.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-static void student_new (api_ret *ret, json_t *rdat);
-static void student_log (api_ret *ret, json_t *rdat);
-static void student_mod (api_ret *ret, json_t *rdat);
-static void student_del (api_ret *ret, json_t *rdat);
+bool api_stat = false;
 
-static void merchant_new (api_ret *ret, json_t *rdat);
-static void merchant_log (api_ret *ret, json_t *rdat);
-static void merchant_mod (api_ret *ret, json_t *rdat);
-static void merchant_del (api_ret *ret, json_t *rdat);
-
-static void menu_list (api_ret *ret, json_t *rdat);
-static void menu_new (api_ret *ret, json_t *rdat);
-static void menu_mod (api_ret *ret, json_t *rdat);
-static void menu_del (api_ret *ret, json_t *rdat);
-
-static void eva_list (api_ret *ret, json_t *rdat);
-static void eva_new (api_ret *ret, json_t *rdat);
-static void eva_mod (api_ret *ret, json_t *rdat);
-static void eva_del (api_ret *ret, json_t *rdat);
+/* every member a request body may carry, each route decodes the ones its
+   schema lists and leaves the rest undefined */
+typedef struct
+{
+  const char *user;
+  const char *pass;
+  const char *token;
+
+  const char *sid; /* "id" of a new student, a string */
+  const char *name;
+  const char *number;
+  const char *position;
+  const char *evaluation;
+
+  const char *npass;
+  const char *nname;
+  const char *nnumber;
+  const char *nposition;
+  const char *nevaluation;
+
+  json_span_t ops; /* the operations of a batch */
+
+  json_int_t id;
+  double price;
+  double grade;
+  double nprice;
+  double ngrade;
+} body_t;
+
+static void student_new (api_ret *ret, const body_t *body);
+static void student_log (api_ret *ret, const body_t *body);
+static void student_mod (api_ret *ret, const body_t *body);
+static void student_del (api_ret *ret, const body_t *body);
+
+static void merchant_new (api_ret *ret, const body_t *body);
+static void merchant_log (api_ret *ret, const body_t *body);
+static void merchant_mod (api_ret *ret, const body_t *body);
+static void merchant_del (api_ret *ret, const body_t *body);
+
+static void menu_list (api_ret *ret, const body_t *body);
+static void menu_new (api_ret *ret, const body_t *body);
+static void menu_mod (api_ret *ret, const body_t *body);
+static void menu_del (api_ret *ret, const body_t *body);
+
+static void eva_list (api_ret *ret, const body_t *body);
+static void eva_new (api_ret *ret, const body_t *body);
+static void eva_mod (api_ret *ret, const body_t *body);
+static void eva_del (api_ret *ret, const body_t *body);
+
+static void sys_stat (api_ret *ret, const body_t *body);
+
+static void api_batch (api_ret *ret, const body_t *body);
 
 #define QUOTE(STR) "\"" STR "\""
 
 #define ISSEQ(S1, S2) (strcmp ((S1), (S2)) == 0)
 
-#define GET(OBJ, KEY, TYP, ERR)                                               \
-  ({                                                                          \
-    json_t *ret = json_object_get ((OBJ), (KEY));                             \
-    if (!json_is_##TYP (ret))                                                 \
-      goto ERR;                                                               \
-    ret;                                                                      \
-  })
-
-#define SET(OBJ, KEY, VAL, ERR)                                               \
+#define OUT_INT(OUT, KEY, VAL)                                                \
   do                                                                          \
-    if (0 != json_object_set ((OBJ), (KEY), (VAL)))                           \
-      goto ERR;                                                               \
+    {                                                                         \
+      json_out_key ((OUT), (KEY));                                            \
+      json_out_int ((OUT), (VAL));                                            \
+    }                                                                         \
   while (0)
 
-#define SET_NEW(OBJ, KEY, VAL, ERR)                                           \
+#define OUT_NUM(OUT, KEY, VAL)                                                \
   do                                                                          \
-    if (0 != json_object_set_new ((OBJ), (KEY), (VAL)))                       \
-      goto ERR;                                                               \
+    {                                                                         \
+      json_out_key ((OUT), (KEY));                                            \
+      json_out_num ((OUT), (VAL));                                            \
+    }                                                                         \
   while (0)
 
 #define RET_STR(PRET, CODE, STR)                                              \
@@ -55,853 +95,1138 @@ static void eva_del (api_ret *ret, json_t *rdat);
     {                                                                         \
       (PRET)->status = (CODE);                                                \
       (PRET)->content = QUOTE (STR);                                          \
+      (PRET)->len = sizeof (QUOTE (STR)) - 1;                                 \
       return;                                                                 \
     }                                                                         \
   while (0)
 
-#define FIND_BY1(TBL, KEY1, TYP1, VAL1)                                       \
+#define FIND_BY1(TBL, COL1, VAL1)                                             \
   ({                                                                          \
-    find_pair_t cnd[]                                                         \
-	= { { .typ = (TYP1), .val = (find_val_t) (VAL1), .key = (KEY1) } };   \
+    find_pair_t cnd[] = { { .col = (COL1), .val = (value_t) (VAL1) } };       \
     find_ret_t ret = find_by ((TBL), cnd, 1);                                 \
     ret;                                                                      \
   })
 
-#define FIND_BY2(TBL, KEY1, TYP1, VAL1, KEY2, TYP2, VAL2)                     \
+#define FIND_BY2(TBL, COL1, VAL1, COL2, VAL2)                                 \
   ({                                                                          \
-    find_pair_t cnd[]                                                         \
-	= { { .typ = (TYP1), .val = (find_val_t) (VAL1), .key = (KEY1) },     \
-	    { .typ = (TYP2), .val = (find_val_t) (VAL2), .key = (KEY2) } };   \
+    find_pair_t cnd[] = { { .col = (COL1), .val = (value_t) (VAL1) },         \
+			  { .col = (COL2), .val = (value_t) (VAL2) } };       \
     find_ret_t ret = find_by ((TBL), cnd, 2);                                 \
     ret;                                                                      \
   })
 
+#define FIND_ALL1(TBL, COL1, VAL1, RET)                                       \
+  ({                                                                          \
+    find_pair_t cnd[] = { { .col = (COL1), .val = (value_t) (VAL1) } };       \
+    find_all ((TBL), cnd, 1, (RET));                                          \
+  })
+
+/* the account of TBL a login handed TOKEN to, without its password */
+#define FIND_SESSION(TBL, TOKEN)                                              \
+  ({                                                                          \
+    find_ret_t ret = { .found = false };                                      \
+    ret.found = session_find ((TOKEN), (TBL), &ret.index);                    \
+    ret;                                                                      \
+  })
+
+/* every endpoint is registered here and nowhere else, with the members
+   its body must carry */
+typedef struct
+{
+  const char *uri;
+  const char *method;
+  bool readonly;
+  void (*fn) (api_ret *ret, const body_t *body);
+  const json_field_t *fields;
+  size_t nfield;
+} route_t;
+
+#define FIELD(KEY, KIND, MEMBER)                                              \
+  { .key = (KEY),                                                             \
+    .len = sizeof (KEY) - 1,                                                  \
+    .kind = JSON_##KIND,                                                      \
+    .off = offsetof (body_t, MEMBER) }
+
+#define STR(MEMBER) FIELD (#MEMBER, STR, MEMBER)
+#define INT(MEMBER) FIELD (#MEMBER, INT, MEMBER)
+#define NUM(MEMBER) FIELD (#MEMBER, NUM, MEMBER)
+#define RAW(MEMBER) FIELD (#MEMBER, RAW, MEMBER)
+
+#define ROUTE(TYPE, API, READONLY, ...)                                       \
+  { .uri = "/api/" #TYPE "/" #API,                                            \
+    .method = "POST",                                                         \
+    .readonly = (READONLY),                                                   \
+    .fn = TYPE##_##API,                                                       \
+    .fields = (const json_field_t[]){ __VA_ARGS__ },                           \
+    .nfield = sizeof ((json_field_t[]){ __VA_ARGS__ }) / sizeof (json_field_t) }
+
+static const route_t routes[] = {
+  ROUTE (student, new, false, STR (user), STR (pass),
+	 FIELD ("id", STR, sid), STR (name), STR (number)),
+  ROUTE (student, log, true, STR (user), STR (pass)),
+  ROUTE (student, del, false, STR (token), STR (pass)),
+  ROUTE (student, mod, false, STR (token), STR (pass), STR (npass),
+	 STR (nname), STR (nnumber)),
+
+  ROUTE (merchant, new, false, STR (user), STR (pass), STR (name),
+	 STR (number), STR (position)),
+  ROUTE (merchant, log, true, STR (user), STR (pass)),
+  ROUTE (merchant, del, false, STR (token), STR (pass)),
+  ROUTE (merchant, mod, false, STR (token), STR (pass), STR (npass),
+	 STR (nname), STR (nnumber), STR (nposition)),
+
+  ROUTE (menu, list, true),
+  ROUTE (menu, new, false, STR (token), STR (name), NUM (price)),
+  ROUTE (menu, mod, false, STR (token), INT (id), STR (nname), NUM (nprice)),
+  ROUTE (menu, del, false, STR (token), INT (id)),
+
+  ROUTE (eva, list, true, INT (id)),
+  ROUTE (eva, new, false, STR (token), INT (id), NUM (grade),
+	 STR (evaluation)),
+  ROUTE (eva, mod, false, STR (token), INT (id), NUM (ngrade),
+	 STR (nevaluation)),
+  ROUTE (eva, del, false, STR (token), INT (id)),
+
+  ROUTE (sys, stat, true),
+
+  { .uri = "/api/batch",
+    .method = "POST",
+    .readonly = false,
+    .fn = api_batch,
+    .fields = (const json_field_t[]){ RAW (ops) },
+    .nfield = 1 },
+};
+
+#define ROUTE_NUM (sizeof (routes) / sizeof (*routes))
+#define ROUTE_SLOTS 64
+#define ROUTE_SEEDS 4096
+
+_Static_assert (ROUTE_NUM <= ROUTE_SLOTS, "ROUTE_SLOTS");
+
+/* a perfect hash, api_init looks for a seed that gives every route a
+   slot of its own, so a lookup is one hash and one compare */
+static const route_t *slots[ROUTE_SLOTS];
+static uint32_t seed;
+
+static inline uint32_t
+route_hash (const char *str, size_t len, uint32_t seed)
+{
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+  return (hash ^ hash >> 15) & (ROUTE_SLOTS - 1);
+}
+
+void
+api_init (void)
+{
+  for (size_t i = 0; i < ROUTE_NUM; i++)
+    if (routes[i].nfield > JSON_FIELDS_MAX)
+      error ("路由字段过多");
+
+  for (seed = 0; seed < ROUTE_SEEDS; seed++)
+    {
+      memset (slots, 0, sizeof (slots));
+
+      size_t i = 0;
+      for (; i < ROUTE_NUM; i++)
+	{
+	  const route_t *route = routes + i;
+	  uint32_t pos = route_hash (route->uri, strlen (route->uri), seed);
+	  if (slots[pos])
+	    break;
+	  slots[pos] = route;
+	}
+
+      if (i == ROUTE_NUM)
+	return;
+    }
+
+  error ("路由表构建失败");
+}
+
+static inline const route_t *
+route_find (struct mg_str uri)
+{
+  const route_t *route = slots[route_hash (uri.buf, uri.len, seed)];
+  if (!route || mg_strcmp (uri, mg_str (route->uri)) != 0)
+    return NULL;
+  return route;
+}
+
+/* the body is decoded in place straight into the members ROUTE asks
+   for */
+static inline void
+route_run (const route_t *route, char *buf, size_t len, api_ret *ret)
+{
+  body_t body;
+
+  switch (json_decode (buf, len, route->fields, route->nfield, &body))
+    {
+    case JSON_BAD:
+      ret->status = API_ERR_NOT_JSON;
+      ret->content = QUOTE ("数据非 JSON 格式");
+      break;
+
+    case JSON_MISSING:
+      ret->status = API_ERR_INCOMPLETE;
+      ret->content = QUOTE ("数据不完整");
+      break;
+
+    default:
+      route->fn (ret, &body);
+    }
+
+  if (!ret->len)
+    ret->len = strlen (ret->content);
+}
+
+/* the route is known before the body is looked at */
 api_ret
 api_handle (struct mg_http_message *msg)
 {
-  api_ret ret = { .need_free = false };
-
-  json_error_t jerr;
-  json_t *rdat = NULL;
+  api_ret ret = { .content = NULL };
+  const route_t *route;
 
-  if (mg_strcmp (msg->method, mg_str ("POST")) != 0)
+  if (!(route = route_find (msg->uri)))
     {
-      ret.status = API_ERR_NOT_POST;
-      ret.content = QUOTE ("非 POST 请求");
+      ret.status = API_ERR_UNKNOWN;
+      ret.content = QUOTE ("未知 API");
       goto ret;
     }
 
-  if (!(rdat = json_loadb (msg->body.buf, msg->body.len, 0, &jerr)))
+  if (mg_strcmp (msg->method, mg_str (route->method)) != 0)
     {
-      ret.status = API_ERR_NOT_JSON;
-      ret.content = QUOTE ("数据非 JSON 格式");
+      ret.status = API_ERR_NOT_POST;
+      ret.content = QUOTE ("非 POST 请求");
       goto ret;
     }
 
-#define API_MATCH(TYPE, API)                                                  \
-  do                                                                          \
-    if (mg_match (msg->uri, mg_str ("/api/" #TYPE "/" #API), NULL))           \
-      {                                                                       \
-	TYPE##_##API (&ret, rdat);                                            \
-	goto ret;                                                             \
-      }                                                                       \
-  while (0)
+  route_run (route, msg->body.buf, msg->body.len, &ret);
 
-  API_MATCH (student, new);
-  API_MATCH (student, log);
-  API_MATCH (student, del);
-  API_MATCH (student, mod);
+ret:
+  if (!ret.len)
+    ret.len = strlen (ret.content);
+  return ret;
+}
 
-  API_MATCH (merchant, new);
-  API_MATCH (merchant, log);
-  API_MATCH (merchant, del);
-  API_MATCH (merchant, mod);
+/* endpoints that only read the tables, they may run side by side */
+bool
+api_readonly (struct mg_http_message *msg)
+{
+  const route_t *route = route_find (msg->uri);
+  return route && route->readonly;
+}
 
-  API_MATCH (menu, list);
-  API_MATCH (menu, new);
-  API_MATCH (menu, mod);
-  API_MATCH (menu, del);
+#define REPLY_HEAD                                                            \
+  "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"                  \
+  "Content-Length: "
+#define REPLY_CODE "{\"code\": "
+#define REPLY_DATA ", \"data\": "
 
-  API_MATCH (eva, list);
-  API_MATCH (eva, new);
-  API_MATCH (eva, mod);
-  API_MATCH (eva, del);
+#define LIT_LEN(LIT) (sizeof (LIT) - 1)
 
-#undef API_MATCH
+static inline size_t
+num_len (size_t num)
+{
+  size_t len = 1;
+  while (num >= 10)
+    num /= 10, len++;
+  return len;
+}
 
-  ret.status = API_ERR_UNKNOWN;
-  ret.content = QUOTE ("未知 API");
+static inline char *
+num_put (char *dst, size_t num)
+{
+  size_t len = num_len (num);
+  for (char *pos = dst + len; pos != dst; num /= 10)
+    *--pos = '0' + num % 10;
+  return dst + len;
+}
 
-ret:
-  json_decref (rdat);
-  return ret;
+static inline char *
+mem_put (char *dst, const char *src, size_t len)
+{
+  memcpy (dst, src, len);
+  return dst + len;
 }
 
-static inline void
-student_new (api_ret *ret, json_t *rdat)
+static inline size_t
+reply_body (const api_ret *ret)
+{
+  return LIT_LEN (REPLY_CODE) + num_len (ret->status)
+	 + LIT_LEN (REPLY_DATA) + ret->len + 1;
+}
+
+/* the whole http response for RET, {"code": STATUS, "data": CONTENT}
+   behind a Content-Length header */
+size_t
+api_reply_size (const api_ret *ret)
+{
+  size_t body = reply_body (ret);
+  return LIT_LEN (REPLY_HEAD) + num_len (body) + 4 + body;
+}
+
+/* writes exactly api_reply_size bytes and returns the end, CONTENT is
+   copied once and never scanned */
+char *
+api_reply (char *dst, const api_ret *ret)
+{
+  dst = mem_put (dst, REPLY_HEAD, LIT_LEN (REPLY_HEAD));
+  dst = num_put (dst, reply_body (ret));
+  dst = mem_put (dst, "\r\n\r\n", 4);
+
+  dst = mem_put (dst, REPLY_CODE, LIT_LEN (REPLY_CODE));
+  dst = num_put (dst, ret->status);
+  dst = mem_put (dst, REPLY_DATA, LIT_LEN (REPLY_DATA));
+  dst = mem_put (dst, ret->content, ret->len);
+  *dst++ = '}';
+  return dst;
+}
+
+#define STREAM_HEAD                                                           \
+  "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"                  \
+  "Transfer-Encoding: chunked\r\n\r\n"
+
+/* a chunk size is written once its data is, in a fixed width ahead of it */
+#define STREAM_HEX 8
+
+/* where api_stream is in a reply */
+enum
+{
+  STREAM_START,
+  STREAM_LIST,
+  STREAM_TAIL,
+  STREAM_DONE,
+};
+
+/* a list that came back as a cursor goes out a chunk at a time as the
+   socket drains, no one builds all of it */
+bool
+api_streamed (const api_ret *ret)
+{
+  return ret->cursor;
+}
+
+/* the next step of a streamed reply, the head with the first chunk, a
+   chunk, or the last chunk with the end; OFF starts at 0 and tells where
+   the reply is; NULL if out of memory */
+char *
+api_stream (char *dst, struct view_cursor *cur, size_t *off)
+{
+  if (*off == STREAM_DONE)
+    return dst;
+
+  if (*off == STREAM_START)
+    dst = mem_put (dst, STREAM_HEAD, LIT_LEN (STREAM_HEAD));
+
+  char *data = dst + STREAM_HEX + 2, *end = data;
+
+  if (*off == STREAM_START)
+    {
+      end = mem_put (end, REPLY_CODE, LIT_LEN (REPLY_CODE));
+      end = num_put (end, API_OK);
+      end = mem_put (end, REPLY_DATA, LIT_LEN (REPLY_DATA));
+      *off = STREAM_LIST;
+    }
+
+  if (*off == STREAM_LIST)
+    {
+      if (!(end = view_next (cur, end, data + API_CHUNK - end)))
+	return NULL;
+      if (view_done (cur))
+	*off = STREAM_TAIL;
+    }
+
+  if (*off == STREAM_TAIL && end < data + API_CHUNK)
+    {
+      *end++ = '}';
+      *off = STREAM_DONE;
+    }
+
+  size_t len = end - data;
+  for (char *pos = dst + STREAM_HEX; pos != dst; len >>= 4)
+    *--pos = "0123456789abcdef"[len & 15];
+  mem_put (dst + STREAM_HEX, "\r\n", 2);
+
+  end = mem_put (end, "\r\n", 2);
+  if (*off == STREAM_DONE)
+    end = mem_put (end, "0\r\n\r\n", 5);
+  return end;
+}
+
+bool
+api_stream_done (size_t off)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
+  return off == STREAM_DONE;
+}
 
-  json_t *id = GET (rdat, "id", string, err);
-  json_t *name = GET (rdat, "name", string, err);
-  json_t *number = GET (rdat, "number", string, err);
+/* a string column of ROW under its field name */
+static inline void
+out_col (json_out_t *out, table_t *tbl, int col, size_t row)
+{
+  sym_t sym = COL_SYM (tbl, col, row);
+  json_out_key (out, tbl->fields[col].key);
+  json_out_str (out, sym_str (sym), sym_len (sym));
+}
 
-  const char *id_str = json_string_value (id);
-  const char *user_str = json_string_value (user);
+static inline void
+student_new (api_ret *ret, const body_t *body)
+{
+  const char *id_str = body->sid;
+  const char *user_str = body->user;
 
-  if (FIND_BY1 (table_student, "user", TYP_STR, user_str).item)
+  if (FIND_BY1 (table_student, STUDENT_USER, user_str).found)
     RET_STR (ret, API_ERR_DUPLICATE, "帐号已存在");
 
-  if (FIND_BY1 (table_student, "id", TYP_STR, id_str).item)
+  if (FIND_BY1 (table_student, STUDENT_ID, id_str).found)
     RET_STR (ret, API_ERR_DUPLICATE, "学号已存在");
 
-  json_t *new;
-  if (!(new = json_object ()))
-    goto err2;
-
-  SET (new, "id", id, err2);
-  SET (new, "user", user, err2);
-  SET (new, "pass", pass, err2);
-  SET (new, "name", name, err2);
-  SET (new, "number", number, err2);
+  value_t vals[] = {
+    [STUDENT_ID] = { .sval = id_str },
+    [STUDENT_USER] = { .sval = user_str },
+    [STUDENT_PASS] = { .sval = body->pass },
+    [STUDENT_NAME] = { .sval = body->name },
+    [STUDENT_NUMBER] = { .sval = body->number },
+  };
 
-  if (0 != json_array_append_new (table_student, new))
-    goto err2;
+  if (!table_grow (table_student) || !log_put (table_student, vals))
+    goto err;
 
-  if (!save (table_student, PATH_TABLE_STUDENT))
-    goto err2;
+  size_t row;
+  table_append (table_student, vals, &row);
+  view_student_put (row);
 
   RET_STR (ret, API_OK, "注册成功");
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-student_log (api_ret *ret, json_t *rdat)
+student_log (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_student, "user", TYP_STR, user_str);
+  const char *user_str = body->user;
+  find_ret_t find = FIND_BY1 (table_student, STUDENT_USER, user_str);
 
-  if (!find.item)
+  if (!find.found)
     RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
 
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  const char *rpass_str = COL_STR (table_student, STUDENT_PASS, find.index);
+  const char *pass_str = body->pass;
 
   if (!ISSEQ (pass_str, rpass_str))
     RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
 
-  char *info_str = json_dumps (find.item, 0);
+  char token[SESSION_TOKEN_LEN + 1];
+  switch (session_new (table_student, find.index, token))
+    {
+    case SESSION_FULL:
+      RET_STR (ret, API_ERR_TOO_MANY, "登录人数过多");
+    case SESSION_FAIL:
+      goto err;
+    }
+
+  json_out_t *out;
+  if (!(out = json_out_new ()))
+    goto err;
+
+  /* everything but the password */
+  json_out_obj (out);
+  out_col (out, table_student, STUDENT_ID, find.index);
+  out_col (out, table_student, STUDENT_USER, find.index);
+  out_col (out, table_student, STUDENT_NAME, find.index);
+  out_col (out, table_student, STUDENT_NUMBER, find.index);
+  json_out_key (out, "token");
+  json_out_str (out, token, SESSION_TOKEN_LEN);
+  json_out_end (out);
+
+  char *info_str = json_out_done (out, &ret->len);
   if (!info_str)
-    goto err2;
+    goto err;
 
   ret->status = API_OK;
-  ret->need_free = true;
   ret->content = info_str;
   return;
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-student_mod (api_ret *ret, json_t *rdat)
+student_mod (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
+  find_ret_t find = FIND_SESSION (table_student, body->token);
 
-  json_t *npass = GET (rdat, "npass", string, err);
-  json_t *nname = GET (rdat, "nname", string, err);
-  json_t *nnumber = GET (rdat, "nnumber", string, err);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_student, "user", TYP_STR, user_str);
+  const char *rpass_str = COL_STR (table_student, STUDENT_PASS, find.index);
+  if (!ISSEQ (body->pass, rpass_str))
+    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+  const char *rname_str = COL_STR (table_student, STUDENT_NAME, find.index);
+  bool repass = !ISSEQ (body->npass, rpass_str);
+  bool renamed = !ISSEQ (body->nname, rname_str);
 
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  value_t vals[FIELD_MAX];
+  table_get (table_student, find.index, vals);
+  vals[STUDENT_PASS].sval = body->npass;
+  vals[STUDENT_NAME].sval = body->nname;
+  vals[STUDENT_NUMBER].sval = body->nnumber;
 
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
+  if (!log_put (table_student, vals))
+    goto err;
 
-  json_t *old = find.item;
-  SET (old, "pass", npass, err2);
-  SET (old, "name", nname, err2);
-  SET (old, "number", nnumber, err2);
+  table_update (table_student, find.index, vals);
 
-  if (!save (table_student, PATH_TABLE_STUDENT))
-    goto err2;
+  if (repass)
+    session_drop (table_student, find.index, body->token);
 
-  RET_STR (ret, API_OK, "修改成功");
+  /* the evaluations only show the name */
+  if (renamed)
+    view_student_put (find.index);
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
+  RET_STR (ret, API_OK, "修改成功");
 
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-student_del (api_ret *ret, json_t *rdat)
+student_del (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_student, "user", TYP_STR, user_str);
+  find_ret_t find = FIND_SESSION (table_student, body->token);
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
-
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  if (!ISSEQ (pass_str, rpass_str))
+  const char *rpass_str = COL_STR (table_student, STUDENT_PASS, find.index);
+  if (!ISSEQ (body->pass, rpass_str))
     RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
 
-  if (0 != json_array_remove (table_student, find.index))
-    goto err2;
+  if (!log_del (table_student, find.index))
+    goto err;
 
-  if (!save (table_student, PATH_TABLE_STUDENT))
-    goto err2;
+  session_drop (table_student, find.index, NULL);
+  view_student_del (find.index);
+  table_remove (table_student, find.index);
 
   RET_STR (ret, API_OK, "注销成功");
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-merchant_new (api_ret *ret, json_t *rdat)
+merchant_new (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-
-  json_t *name = GET (rdat, "name", string, err);
-  json_t *number = GET (rdat, "number", string, err);
-  json_t *position = GET (rdat, "position", string, err);
+  const char *user_str = body->user;
+  const char *name_str = body->name;
 
-  const char *user_str = json_string_value (user);
-  const char *name_str = json_string_value (name);
-
-  if (FIND_BY1 (table_merchant, "user", TYP_STR, user_str).item)
+  if (FIND_BY1 (table_merchant, MERCHANT_USER, user_str).found)
     RET_STR (ret, API_ERR_DUPLICATE, "帐号已存在");
 
-  if (FIND_BY1 (table_merchant, "name", TYP_STR, name_str).item)
+  if (FIND_BY1 (table_merchant, MERCHANT_NAME, name_str).found)
     RET_STR (ret, API_ERR_DUPLICATE, "店名已存在");
 
-  json_t *new;
-  if (!(new = json_object ()))
-    goto err2;
-
-  SET (new, "user", user, err2);
-  SET (new, "pass", pass, err2);
-  SET (new, "name", name, err2);
-  SET (new, "number", number, err2);
-  SET (new, "position", position, err2);
+  value_t vals[] = {
+    [MERCHANT_USER] = { .sval = user_str },
+    [MERCHANT_PASS] = { .sval = body->pass },
+    [MERCHANT_NAME] = { .sval = name_str },
+    [MERCHANT_NUMBER] = { .sval = body->number },
+    [MERCHANT_POSITION] = { .sval = body->position },
+  };
 
-  if (0 != json_array_append_new (table_merchant, new))
-    goto err2;
+  if (!table_grow (table_merchant) || !log_put (table_merchant, vals))
+    goto err;
 
-  if (!save (table_merchant, PATH_TABLE_MERCHANT))
-    goto err2;
+  size_t row;
+  table_append (table_merchant, vals, &row);
+  view_merchant_put (row);
 
   RET_STR (ret, API_OK, "注册成功");
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-merchant_log (api_ret *ret, json_t *rdat)
+merchant_log (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_merchant, "user", TYP_STR, user_str);
+  const char *user_str = body->user;
+  find_ret_t find = FIND_BY1 (table_merchant, MERCHANT_USER, user_str);
 
-  if (!find.item)
+  if (!find.found)
     RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
 
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  const char *rpass_str = COL_STR (table_merchant, MERCHANT_PASS, find.index);
+  const char *pass_str = body->pass;
 
   if (!ISSEQ (pass_str, rpass_str))
     RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
 
-  char *info_str = json_dumps (find.item, 0);
+  char token[SESSION_TOKEN_LEN + 1];
+  switch (session_new (table_merchant, find.index, token))
+    {
+    case SESSION_FULL:
+      RET_STR (ret, API_ERR_TOO_MANY, "登录人数过多");
+    case SESSION_FAIL:
+      goto err;
+    }
+
+  json_out_t *out;
+  if (!(out = json_out_new ()))
+    goto err;
+
+  /* everything but the password */
+  json_out_obj (out);
+  out_col (out, table_merchant, MERCHANT_USER, find.index);
+  out_col (out, table_merchant, MERCHANT_NAME, find.index);
+  out_col (out, table_merchant, MERCHANT_NUMBER, find.index);
+  out_col (out, table_merchant, MERCHANT_POSITION, find.index);
+  json_out_key (out, "token");
+  json_out_str (out, token, SESSION_TOKEN_LEN);
+  json_out_end (out);
+
+  char *info_str = json_out_done (out, &ret->len);
   if (!info_str)
-    goto err2;
+    goto err;
 
   ret->status = API_OK;
-  ret->need_free = true;
   ret->content = info_str;
   return;
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-merchant_mod (api_ret *ret, json_t *rdat)
+merchant_mod (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-
-  json_t *npass = GET (rdat, "npass", string, err);
-  json_t *nname = GET (rdat, "nname", string, err);
-  json_t *nnumber = GET (rdat, "nnumber", string, err);
-  json_t *nposition = GET (rdat, "nposition", string, err);
+  find_ret_t find = FIND_SESSION (table_merchant, body->token);
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_merchant, "user", TYP_STR, user_str);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+  const char *rpass_str = COL_STR (table_merchant, MERCHANT_PASS, find.index);
+  if (!ISSEQ (body->pass, rpass_str))
+    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
 
-  const char *nname_str = json_string_value (nname);
-  find_ret_t find2 = FIND_BY1 (table_merchant, "name", TYP_STR, nname_str);
+  const char *nname_str = body->nname;
+  find_ret_t find2 = FIND_BY1 (table_merchant, MERCHANT_NAME, nname_str);
 
-  if (find2.item)
-    {
-      json_t *euser = GET (find2.item, "user", string, err2);
-      const char *euser_str = json_string_value (euser);
-
-      if (!ISSEQ (user_str, euser_str))
-	RET_STR (ret, API_ERR_DUPLICATE, "店名已存在");
-    }
+  if (find2.found && find2.index != find.index)
+    RET_STR (ret, API_ERR_DUPLICATE, "店名已存在");
 
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  bool repass = !ISSEQ (body->npass, rpass_str);
+  const char *rname_str = COL_STR (table_merchant, MERCHANT_NAME, find.index);
+  const char *rpos_str = COL_STR (table_merchant, MERCHANT_POSITION,
+				  find.index);
+  bool renamed
+      = !ISSEQ (nname_str, rname_str) || !ISSEQ (body->nposition, rpos_str);
+
+  value_t vals[FIELD_MAX];
+  table_get (table_merchant, find.index, vals);
+  vals[MERCHANT_PASS].sval = body->npass;
+  vals[MERCHANT_NAME].sval = nname_str;
+  vals[MERCHANT_NUMBER].sval = body->nnumber;
+  vals[MERCHANT_POSITION].sval = body->nposition;
+
+  if (!log_put (table_merchant, vals))
+    goto err;
 
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
+  table_update (table_merchant, find.index, vals);
 
-  json_t *old = find.item;
-  SET (old, "pass", npass, err2);
-  SET (old, "name", nname, err2);
-  SET (old, "number", nnumber, err2);
-  SET (old, "position", nposition, err2);
+  if (repass)
+    session_drop (table_merchant, find.index, body->token);
 
-  if (!save (table_merchant, PATH_TABLE_MERCHANT))
-    goto err2;
+  /* the menu only shows the name and the position */
+  if (renamed)
+    view_merchant_put (find.index);
 
   RET_STR (ret, API_OK, "修改成功");
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-merchant_del (api_ret *ret, json_t *rdat)
+merchant_del (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_merchant, "user", TYP_STR, user_str);
-
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+  find_ret_t find = FIND_SESSION (table_merchant, body->token);
 
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  if (!ISSEQ (pass_str, rpass_str))
+  const char *rpass_str = COL_STR (table_merchant, MERCHANT_PASS, find.index);
+  if (!ISSEQ (body->pass, rpass_str))
     RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
 
-  if (0 != json_array_remove (table_merchant, find.index))
-    goto err2;
+  if (!log_del (table_merchant, find.index))
+    goto err;
 
-  if (!save (table_merchant, PATH_TABLE_MERCHANT))
-    goto err2;
+  session_drop (table_merchant, find.index, NULL);
+  view_merchant_del (find.index);
+  table_remove (table_merchant, find.index);
 
   RET_STR (ret, API_OK, "注销成功");
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-menu_list (api_ret *ret, json_t *rdat)
+menu_list (api_ret *ret, const body_t *body)
 {
-  json_t *user = json_object_get (rdat, "user");
-  size_t num = json_array_size (table_menu);
-  json_t *arr, *temp;
-
-  if (!(arr = json_array ()))
-    goto err;
+  (void) body;
 
-  for (size_t i = 0; i < num; i++)
+  const char *cached;
+  if ((cached = cache_menu (&ret->len)))
     {
-      json_t *item = json_array_get (table_menu, i);
-
-      json_t *id = GET (item, "id", integer, err);
-      json_t *name = GET (item, "name", string, err);
-      json_t *user = GET (item, "user", string, err);
-      json_t *price = GET (item, "price", number, err);
-
-      const char *user_str = json_string_value (user);
-      find_ret_t find = FIND_BY1 (table_merchant, "user", TYP_STR, user_str);
-
-      json_t *uname = GET (find.item, "name", string, err);
-      json_t *position = GET (find.item, "position", string, err);
-
-      if (!(temp = json_object ()))
-	goto err2;
+      ret->content = cached;
+      ret->shared = true;
+      ret->status = API_OK;
+      return;
+    }
 
-      SET (temp, "id", id, err3);
-      SET (temp, "name", name, err3);
-      SET (temp, "user", user, err3);
-      SET (temp, "price", price, err3);
-      SET (temp, "uname", uname, err3);
-      SET (temp, "position", position, err3);
+  size_t size;
+  if (!view_size (table_menu, view_menu, NULL, table_menu->num, &size))
+    goto err;
 
-      if (0 != json_array_append_new (arr, temp))
-	goto err3;
+  /* a long list is never built whole, it goes out as the socket drains */
+  if (size > API_CHUNK && !ret->whole)
+    {
+      if (!(ret->cursor = view_open (table_menu, NULL, 0)))
+	goto err;
+      ret->status = API_OK;
+      ret->content = "";
+      return;
     }
 
-  char *list_str = json_dumps (arr, 0);
+  char *list_str = view_list (table_menu, view_menu, NULL, table_menu->num,
+			      size, &ret->len);
   if (!list_str)
-    goto err2;
+    goto err;
 
-  ret->content = list_str;
-  ret->need_free = true;
+  cached = cache_menu_put (list_str, ret->len);
+  ret->content = cached ? cached : list_str;
+  ret->shared = cached;
   ret->status = API_OK;
-  json_decref (arr);
   return;
 
-err3:
-  json_decref (temp);
-
-err2:
-  json_decref (arr);
-
 err:
   RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-menu_new (api_ret *ret, json_t *rdat)
+menu_new (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
+  find_ret_t find = FIND_SESSION (table_merchant, body->token);
 
-  json_t *name = GET (rdat, "name", string, err);
-  json_t *price = GET (rdat, "price", number, err);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_merchant, "user", TYP_STR, user_str);
+  const char *user_str = COL_STR (table_merchant, MERCHANT_USER, find.index);
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
-
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
-
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
+  value_t vals[] = {
+    [MENU_ID] = { .ival = table_menu->serial },
+    [MENU_NAME] = { .sval = body->name },
+    [MENU_USER] = { .sval = user_str },
+    [MENU_PRICE] = { .nval = body->price },
+  };
 
-  json_t *id, *new;
-  json_int_t id_int = 0;
-  size_t size = json_array_size (table_menu);
-
-  if (size)
-    {
-      json_t *last = json_array_get (table_menu, size - 1);
-      json_t *last_id = GET (last, "id", integer, err2);
-      id_int = json_integer_value (last_id) + 1;
-    }
-
-  if (!(id = json_integer (id_int)))
-    goto err2;
-
-  if (!(new = json_object ()))
-    goto err3;
-
-  SET_NEW (new, "id", id, err4);
-  SET (new, "name", name, err4);
-  SET (new, "user", user, err4);
-  SET (new, "price", price, err4);
-
-  if (0 != json_array_append_new (table_menu, new))
-    goto err4;
+  if (!table_grow (table_menu) || !log_put (table_menu, vals))
+    goto err;
 
-  if (!save (table_menu, PATH_TABLE_MENU))
-    goto err4;
+  size_t row;
+  table_append (table_menu, vals, &row);
+  view_menu_put (row);
 
   RET_STR (ret, API_OK, "添加成功");
 
-err4:
-  json_decref (new);
-
-err3:
-  json_decref (id);
-
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-menu_mod (api_ret *ret, json_t *rdat)
+menu_mod (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-
-  json_t *id = GET (rdat, "id", integer, err);
-  json_t *nname = GET (rdat, "nname", string, err);
-  json_t *nprice = GET (rdat, "nprice", number, err);
+  find_ret_t find = FIND_SESSION (table_merchant, body->token);
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_merchant, "user", TYP_STR, user_str);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+  const char *user_str = COL_STR (table_merchant, MERCHANT_USER, find.index);
 
-  json_int_t id_int = json_integer_value (id);
-  find_ret_t find2 = FIND_BY1 (table_menu, "id", TYP_INT, id_int);
+  json_int_t id_int = body->id;
+  find_ret_t find2 = FIND_BY1 (table_menu, MENU_ID, id_int);
 
-  if (!find2.item)
+  if (!find2.found)
     RET_STR (ret, API_ERR_NOT_EXIST, "菜品不存在");
 
-  json_t *ruser = GET (find2.item, "user", string, err2);
-  const char *ruser_str = json_string_value (ruser);
+  const char *ruser_str = COL_STR (table_menu, MENU_USER, find2.index);
 
   if (!ISSEQ (user_str, ruser_str))
     RET_STR (ret, API_ERR_NOT_EXIST, "菜品非该商户所有");
 
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  value_t vals[FIELD_MAX];
+  table_get (table_menu, find2.index, vals);
+  vals[MENU_NAME].sval = body->nname;
+  vals[MENU_PRICE].nval = body->nprice;
 
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
-
-  json_t *old = find2.item;
-  SET (old, "name", nname, err2);
-  SET (old, "price", nprice, err2);
+  if (!log_put (table_menu, vals))
+    goto err;
 
-  if (!save (table_menu, PATH_TABLE_MENU))
-    goto err2;
+  table_update (table_menu, find2.index, vals);
+  view_menu_put (find2.index);
 
   RET_STR (ret, API_OK, "修改成功");
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-menu_del (api_ret *ret, json_t *rdat)
+menu_del (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
-  json_t *id = GET (rdat, "id", integer, err);
+  find_ret_t find = FIND_SESSION (table_merchant, body->token);
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find = FIND_BY1 (table_merchant, "user", TYP_STR, user_str);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+  const char *user_str = COL_STR (table_merchant, MERCHANT_USER, find.index);
 
-  json_int_t id_int = json_integer_value (id);
-  find_ret_t find2 = FIND_BY1 (table_menu, "id", TYP_INT, id_int);
+  json_int_t id_int = body->id;
+  find_ret_t find2 = FIND_BY1 (table_menu, MENU_ID, id_int);
 
-  if (!find2.item)
+  if (!find2.found)
     RET_STR (ret, API_ERR_NOT_EXIST, "菜品不存在");
 
-  json_t *ruser = GET (find2.item, "user", string, err2);
-  const char *ruser_str = json_string_value (ruser);
+  const char *ruser_str = COL_STR (table_menu, MENU_USER, find2.index);
 
   if (!ISSEQ (user_str, ruser_str))
     RET_STR (ret, API_ERR_NOT_EXIST, "菜品非该商户所有");
 
-  json_t *rpass = GET (find.item, "pass", string, err2);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
-
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
-
-  if (0 != json_array_remove (table_menu, find2.index))
-    goto err2;
+  if (!log_del (table_menu, find2.index))
+    goto err;
 
-  if (!save (table_menu, PATH_TABLE_MENU))
-    goto err2;
+  view_menu_del (find2.index);
+  cache_eva_drop (id_int);
+  table_remove (table_menu, find2.index);
 
   RET_STR (ret, API_OK, "修改成功");
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-eva_list (api_ret *ret, json_t *rdat)
+eva_list (api_ret *ret, const body_t *body)
 {
-  json_t *arr, *temp;
-  json_t *id = GET (rdat, "id", integer, err);
-  json_int_t id_int = json_integer_value (id);
-  size_t size = json_array_size (table_evaluation);
-
-  if (!(arr = json_array ()))
-    goto err2;
+  table_t *tbl = table_evaluation;
+  json_int_t id_int = body->id;
 
-  for (size_t i = 0; i < size; i++)
+  const char *cached;
+  if ((cached = cache_eva (id_int, &ret->len)))
     {
-      json_t *item = json_array_get (table_evaluation, i);
-
-      json_t *item_id = GET (item, "id", integer, err2);
-      json_int_t item_id_int = json_integer_value (item_id);
-
-      if (item_id_int != id_int)
-	continue;
-
-      json_t *evaluation = GET (item, "evaluation", string, err2);
-      json_t *grade = GET (item, "grade", number, err2);
-      json_t *user = GET (item, "user", string, err2);
-      const char *user_str = json_string_value (user);
-
-      find_ret_t find = FIND_BY1 (table_student, "user", TYP_STR, user_str);
-      json_t *uname = GET (find.item, "name", string, err2);
-      const char *uname_str = json_string_value (uname);
+      ret->content = cached;
+      ret->shared = true;
+      ret->status = API_OK;
+      return;
+    }
 
-      if (!(temp = json_object ()))
-	goto err2;
+  find_all_t all;
+  if (!FIND_ALL1 (tbl, EVA_ID, id_int, &all))
+    goto err;
 
-      SET (temp, "id", id, err4);
-      SET (temp, "user", user, err4);
-      SET (temp, "uname", uname, err4);
-      SET (temp, "grade", grade, err4);
-      SET (temp, "evaluation", evaluation, err4);
+  size_t size;
+  if (!view_size (tbl, view_eva, all.rows, all.num, &size))
+    {
+      free (all.rows);
+      goto err;
+    }
 
-      if (0 != json_array_append_new (arr, temp))
-	goto err4;
+  if (size > API_CHUNK && !ret->whole)
+    {
+      ret->cursor = view_open (tbl, all.rows, all.num);
+      free (all.rows);
+      if (!ret->cursor)
+	goto err;
+      ret->status = API_OK;
+      ret->content = "";
+      return;
     }
 
-  char *list_str = json_dumps (arr, 0);
+  char *list_str = view_list (tbl, view_eva, all.rows, all.num, size,
+			      &ret->len);
+  free (all.rows);
   if (!list_str)
-    goto err3;
+    goto err;
 
-  ret->content = list_str;
-  ret->need_free = true;
+  /* any other id would only grow the cache */
+  cached = FIND_BY1 (table_menu, MENU_ID, id_int).found
+	       ? cache_eva_put (id_int, list_str, ret->len)
+	       : NULL;
+  ret->content = cached ? cached : list_str;
+  ret->shared = cached;
   ret->status = API_OK;
-  json_decref (arr);
   return;
 
-err4:
-  json_decref (temp);
-
-err3:
-  json_decref (arr);
-
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-eva_new (api_ret *ret, json_t *rdat)
+eva_new (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
+  json_int_t id_int = body->id;
+  find_ret_t find = FIND_BY1 (table_menu, MENU_ID, id_int);
 
-  json_t *id = GET (rdat, "id", integer, err);
-  json_t *grade = GET (rdat, "grade", number, err);
-  json_t *evaluation = GET (rdat, "evaluation", string, err);
-
-  json_int_t id_int = json_integer_value (id);
-  find_ret_t find = FIND_BY1 (table_menu, "id", TYP_INT, id_int);
-
-  if (!find.item)
+  if (!find.found)
     RET_STR (ret, API_ERR_NOT_EXIST, "菜品不存在");
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find2 = FIND_BY1 (table_student, "user", TYP_STR, user_str);
+  find_ret_t find2 = FIND_SESSION (table_student, body->token);
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+  if (!find2.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  json_t *rpass = GET (find2.item, "pass", string, err);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
-
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
+  const char *user_str = COL_STR (table_student, STUDENT_USER, find2.index);
 
-  find_ret_t find3 = FIND_BY2 (table_evaluation, "id", TYP_INT, id_int, "user",
-			       TYP_STR, user_str);
+  find_ret_t find3
+      = FIND_BY2 (table_evaluation, EVA_ID, id_int, EVA_USER, user_str);
 
-  if (find3.item)
+  if (find3.found)
     RET_STR (ret, API_ERR_DUPLICATE, "已经评价过该菜品");
 
-  json_t *new;
-  if (!(new = json_object ()))
-    goto err2;
+  value_t vals[] = {
+    [EVA_ID] = { .ival = id_int },
+    [EVA_USER] = { .sval = user_str },
+    [EVA_GRADE] = { .nval = body->grade },
+    [EVA_EVALUATION] = { .sval = body->evaluation },
+  };
 
-  SET (new, "id", id, err3);
-  SET (new, "user", user, err3);
-  SET (new, "grade", grade, err3);
-  SET (new, "evaluation", evaluation, err3);
+  cache_eva_drop (id_int);
 
-  if (0 != json_array_append_new (table_evaluation, new))
-    goto err3;
+  if (!table_grow (table_evaluation) || !log_put (table_evaluation, vals))
+    goto err;
 
-  if (!save (table_evaluation, PATH_TABLE_EVALUATION))
-    goto err3;
+  size_t row;
+  table_append (table_evaluation, vals, &row);
+  view_eva_put (row);
 
   RET_STR (ret, API_OK, "评价成功");
 
-err3:
-  json_decref (new);
-
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
-
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
 static inline void
-eva_mod (api_ret *ret, json_t *rdat)
+eva_mod (api_ret *ret, const body_t *body)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
+  json_int_t id_int = body->id;
+  find_ret_t find = FIND_BY1 (table_menu, MENU_ID, id_int);
 
-  json_t *id = GET (rdat, "id", integer, err);
-  json_t *ngrade = GET (rdat, "ngrade", number, err);
-  json_t *nevaluation = GET (rdat, "nevaluation", string, err);
+  if (!find.found)
+    RET_STR (ret, API_ERR_NOT_EXIST, "菜品不存在");
 
-  json_int_t id_int = json_integer_value (id);
-  find_ret_t find = FIND_BY1 (table_menu, "id", TYP_INT, id_int);
+  find_ret_t find2 = FIND_SESSION (table_student, body->token);
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "菜品不存在");
+  if (!find2.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find2 = FIND_BY1 (table_student, "user", TYP_STR, user_str);
+  const char *user_str = COL_STR (table_student, STUDENT_USER, find2.index);
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+  find_ret_t find3
+      = FIND_BY2 (table_evaluation, EVA_ID, id_int, EVA_USER, user_str);
+
+  if (!find3.found)
+    RET_STR (ret, API_ERR_NOT_EXIST, "未评价过该菜品");
 
-  json_t *rpass = GET (find2.item, "pass", string, err);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  value_t vals[FIELD_MAX];
+  table_get (table_evaluation, find3.index, vals);
+  vals[EVA_GRADE].nval = body->ngrade;
+  vals[EVA_EVALUATION].sval = body->nevaluation;
 
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
+  if (!log_put (table_evaluation, vals))
+    goto err;
 
-  find_ret_t find3 = FIND_BY2 (table_evaluation, "id", TYP_INT, id_int, "user",
-			       TYP_STR, user_str);
+  cache_eva_drop (id_int);
+  table_update (table_evaluation, find3.index, vals);
+  view_eva_put (find3.index);
 
-  if (!find3.item)
+  RET_STR (ret, API_OK, "修改成功");
+
+err:
+  RET_STR (ret, API_ERR_INNER, "内部错误");
+}
+
+static inline void
+eva_del (api_ret *ret, const body_t *body)
+{
+  json_int_t id_int = body->id;
+  find_ret_t find = FIND_BY1 (table_menu, MENU_ID, id_int);
+
+  if (!find.found)
+    RET_STR (ret, API_ERR_NOT_EXIST, "菜品不存在");
+
+  find_ret_t find2 = FIND_SESSION (table_student, body->token);
+
+  if (!find2.found)
+    RET_STR (ret, API_ERR_NO_SESSION, "登录已失效");
+
+  const char *user_str = COL_STR (table_student, STUDENT_USER, find2.index);
+
+  find_ret_t find3
+      = FIND_BY2 (table_evaluation, EVA_ID, id_int, EVA_USER, user_str);
+
+  if (!find3.found)
     RET_STR (ret, API_ERR_NOT_EXIST, "未评价过该菜品");
 
-  json_t *old = find3.item;
-  SET (old, "grade", ngrade, err2);
-  SET (old, "evaluation", nevaluation, err2);
+  if (!log_del (table_evaluation, find3.index))
+    goto err;
 
-  if (!save (table_evaluation, PATH_TABLE_EVALUATION))
-    goto err2;
+  cache_eva_drop (id_int);
+  view_eva_del (find3.index);
+  table_remove (table_evaluation, find3.index);
 
-  RET_STR (ret, API_OK, "修改成功");
+  RET_STR (ret, API_OK, "删除成功");
 
-err2:
+err:
   RET_STR (ret, API_ERR_INNER, "内部错误");
+}
+
+static inline void
+sys_stat (api_ret *ret, const body_t *body)
+{
+  (void) body;
+
+  if (!api_stat)
+    RET_STR (ret, API_ERR_UNKNOWN, "未知 API");
+
+  json_out_t *out;
+  log_stat_t lstat = log_stat ();
+  cache_stat_t cstat = cache_stat ();
+
+  if (!(out = json_out_new ()))
+    goto err;
+
+  json_out_obj (out);
+  json_out_key (out, "log");
+  json_out_obj (out);
+
+  uint64_t batches = lstat.batches ? lstat.batches : 1;
+  OUT_INT (out, "batches", lstat.batches);
+  OUT_INT (out, "records", lstat.records);
+  OUT_INT (out, "last_batch", lstat.last_batch);
+  OUT_INT (out, "max_batch", lstat.max_batch);
+  OUT_NUM (out, "avg_batch", (double) lstat.records / batches);
+  OUT_INT (out, "last_us", lstat.last_us);
+  OUT_INT (out, "max_us", lstat.max_us);
+  OUT_INT (out, "avg_us", lstat.total_us / batches);
+  OUT_INT (out, "coalesced", lstat.records - lstat.batches);
+  json_out_end (out);
+
+  json_out_key (out, "cache");
+  json_out_obj (out);
+  OUT_INT (out, "hits", cstat.hits);
+  OUT_INT (out, "misses", cstat.misses);
+  json_out_end (out);
+  json_out_end (out);
+
+  char *stat_str = json_out_done (out, &ret->len);
+  if (!stat_str)
+    goto err;
+
+  ret->content = stat_str;
+  ret->status = API_OK;
+  return;
 
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
 
+/* one element of a batch, {"uri": ..., "body": {...}} */
+typedef struct
+{
+  const char *uri;
+  json_span_t body;
+} op_t;
+
+static const json_field_t op_fields[] = {
+  { .key = "uri", .len = 3, .kind = JSON_STR, .off = offsetof (op_t, uri) },
+  { .key = "body", .len = 4, .kind = JSON_RAW, .off = offsetof (op_t, body) },
+};
+
 static inline void
-eva_del (api_ret *ret, json_t *rdat)
+op_run (json_span_t item, api_ret *ret)
 {
-  json_t *user = GET (rdat, "user", string, err);
-  json_t *pass = GET (rdat, "pass", string, err);
+  const route_t *route;
+  op_t op;
 
-  json_t *id = GET (rdat, "id", integer, err);
+  switch (json_decode (item.buf, item.len, op_fields,
+		       sizeof (op_fields) / sizeof (*op_fields), &op))
+    {
+    case JSON_BAD:
+      RET_STR (ret, API_ERR_NOT_JSON, "数据非 JSON 格式");
 
-  json_int_t id_int = json_integer_value (id);
-  find_ret_t find = FIND_BY1 (table_menu, "id", TYP_INT, id_int);
+    case JSON_MISSING:
+      RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+    }
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "菜品不存在");
+  if (!(route = route_find (mg_str (op.uri))) || route->fn == api_batch)
+    RET_STR (ret, API_ERR_UNKNOWN, "未知 API");
 
-  const char *user_str = json_string_value (user);
-  find_ret_t find2 = FIND_BY1 (table_student, "user", TYP_STR, user_str);
+  route_run (route, op.body.buf, op.body.len, ret);
+}
 
-  if (!find.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "帐号不存在");
+/* every operation runs in order as if it came on its own, under the same
+   lock, and their records reach the log together; the reply holds their
+   replies in order, as {"code": ..., "data": ...}, under API_ERR_INNER
+   if the records could not be written */
+static inline void
+api_batch (api_ret *ret, const body_t *body)
+{
+  json_span_t *items;
+  size_t num;
 
-  json_t *rpass = GET (find2.item, "pass", string, err);
-  const char *rpass_str = json_string_value (rpass);
-  const char *pass_str = json_string_value (pass);
+  if (json_items (body->ops.buf, body->ops.len, &items, &num) != JSON_OK)
+    RET_STR (ret, API_ERR_NOT_JSON, "数据非 JSON 格式");
 
-  if (!ISSEQ (pass_str, rpass_str))
-    RET_STR (ret, API_ERR_WRONG_PASS, "密码错误");
+  if (num > API_BATCH_MAX)
+    RET_STR (ret, API_ERR_TOO_MANY, "操作过多");
 
-  find_ret_t find3 = FIND_BY2 (table_evaluation, "id", TYP_INT, id_int, "user",
-			       TYP_STR, user_str);
+  json_out_t *out;
+  if (!(out = json_out_new ()))
+    goto err;
 
-  if (!find3.item)
-    RET_STR (ret, API_ERR_NOT_EXIST, "未评价过该菜品");
+  json_out_arr (out);
+  log_hold ();
 
-  if (0 != json_array_remove (table_evaluation, find3.index))
-    goto err2;
+  for (size_t i = 0; i < num; i++)
+    {
+      api_ret one = { .content = NULL, .whole = true };
+      op_run (items[i], &one);
+
+      json_out_obj (out);
+      OUT_INT (out, "code", one.status);
+      json_out_key (out, "data");
+      json_out_raw (out, one.content, one.len);
+      json_out_end (out);
+    }
 
-  if (!save (table_evaluation, PATH_TABLE_EVALUATION))
-    goto err2;
+  bool logged = log_release ();
 
-  RET_STR (ret, API_OK, "删除成功");
+  json_out_end (out);
 
-err2:
-  RET_STR (ret, API_ERR_INNER, "内部错误");
+  char *list_str = json_out_done (out, &ret->len);
+  if (!list_str)
+    goto err;
+
+  ret->content = list_str;
+  ret->status = logged ? API_OK : API_ERR_INNER;
+  return;
 
 err:
-  RET_STR (ret, API_ERR_INCOMPLETE, "数据不完整");
+  RET_STR (ret, API_ERR_INNER, "内部错误");
 }
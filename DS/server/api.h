@@ -2,6 +2,7 @@
 #define API_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 enum
 {
@@ -14,16 +15,46 @@ enum
   API_ERR_INNER,
   API_ERR_NOT_EXIST,
   API_ERR_WRONG_PASS,
+  API_ERR_NO_SESSION,
+  API_ERR_TOO_MANY,
 };
 
+/* CONTENT is static or lives in the request arena until arena_reset, LEN
+   is its length once api_handle returns; SHARED content is a cache buffer
+   that cache_pin keeps past arena_reset; a list longer than a chunk comes
+   back as CURSOR instead, unless WHOLE asks for it in CONTENT */
 typedef struct
 {
   int status;
-  bool need_free;
   const char *content;
+  size_t len;
+  bool shared;
+  bool whole;
+  struct view_cursor *cursor;
 } api_ret;
 
+/* body bytes per chunk of a streamed reply, and the most one step of
+   api_stream writes */
+#define API_CHUNK 65536
+#define API_STREAM_STEP (API_CHUNK + 128)
+
+/* operations one /api/batch request may carry */
+#define API_BATCH_MAX 1024
+
+/* /api/sys/stat has no login of its own, it only answers when whoever
+   runs the server asks for it */
+extern bool api_stat;
+
 struct mg_http_message;
+extern void api_init (void);
 extern api_ret api_handle (struct mg_http_message *msg);
+extern bool api_readonly (struct mg_http_message *msg);
+
+extern size_t api_reply_size (const api_ret *ret);
+extern char *api_reply (char *dst, const api_ret *ret);
+
+extern bool api_streamed (const api_ret *ret);
+extern char *api_stream (char *dst, struct view_cursor *cur, size_t *off);
+extern bool api_stream_done (size_t off);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "arena.h"
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ARENA_BLOCK 65536
+#define ARENA_KEEP_MAX (4 << 20)
+
+typedef struct block_t
+{
+  struct block_t *next;
+  size_t size;
+  size_t used;
+  alignas (max_align_t) char data[];
+} block_t;
+
+typedef struct defer_t
+{
+  struct defer_t *next;
+  void (*fn) (void *);
+  void *arg;
+} defer_t;
+
+/* HEAD is the block being carved, older full blocks hang off it */
+static __thread block_t *head;
+static __thread defer_t *defers;
+
+static inline block_t *
+block_new (size_t size, block_t *next)
+{
+  block_t *blk;
+  if (!(blk = malloc (sizeof (block_t) + size)))
+    return NULL;
+
+  blk->next = next;
+  blk->size = size;
+  blk->used = 0;
+  return blk;
+}
+
+void *
+arena_alloc (size_t size)
+{
+  size_t align = alignof (max_align_t);
+  size = (size + align - 1) & ~(align - 1);
+
+  if (!head || head->size - head->used < size)
+    {
+      size_t want = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+      block_t *blk = block_new (want, head);
+      if (!blk)
+	return NULL;
+      head = blk;
+    }
+
+  void *ptr = head->data + head->used;
+  head->used += size;
+  return ptr;
+}
+
+/* memory only goes back in bulk */
+void
+arena_free (void *ptr)
+{
+  (void) ptr;
+}
+
+/* FN (ARG) runs at the next arena_reset, for memory owned elsewhere that
+   the request hands out as if it were its own */
+bool
+arena_defer (void (*fn) (void *), void *arg)
+{
+  defer_t *defer;
+  if (!(defer = arena_alloc (sizeof (defer_t))))
+    return false;
+
+  *defer = (defer_t){ .next = defers, .fn = fn, .arg = arg };
+  defers = defer;
+  return true;
+}
+
+static inline void
+defer_run (void)
+{
+  for (defer_t *defer = defers; defer; defer = defer->next)
+    defer->fn (defer->arg);
+  defers = NULL;
+}
+
+/* a request that spilled into several blocks leaves one block as large
+   as all of them, so the next one of its size fits without growing */
+void
+arena_reset (void)
+{
+  defer_run ();
+
+  if (!head)
+    return;
+
+  if (!head->next)
+    {
+      head->used = 0;
+      return;
+    }
+
+  size_t total = 0;
+  for (block_t *blk = head, *next; blk; blk = next)
+    {
+      next = blk->next;
+      total += blk->size;
+      free (blk);
+    }
+
+  if (total > ARENA_KEEP_MAX)
+    total = ARENA_KEEP_MAX;
+
+  head = block_new (total, NULL);
+}
+
+/* for threads that exit, nothing is kept for a next request */
+void
+arena_release (void)
+{
+  defer_run ();
+
+  for (block_t *blk = head, *next; blk; blk = next)
+    {
+      next = blk->next;
+      free (blk);
+    }
+
+  head = NULL;
+}
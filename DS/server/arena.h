@@ -0,0 +1,15 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* per-thread bump allocator for everything a single request builds,
+   released all at once by arena_reset */
+extern void *arena_alloc (size_t size);
+extern void arena_free (void *ptr);
+extern bool arena_defer (void (*fn) (void *), void *arg);
+extern void arena_reset (void);
+extern void arena_release (void);
+
+#endif
@@ -0,0 +1,275 @@
+/* load generator for the server, one blocking keep-alive connection per
+   thread, e.g. compare worker pool sizes with
+
+     ./server -w 1 &  ./bench -c 32 -u /api/menu/list
+     ./server -w 4 &  ./bench -c 32 -u /api/menu/list
+
+   or the io_uring loop against mongoose, after make REACTOR=uring
+
+     ./server &     ./bench -c 16 -u /api/menu/list
+     ./server -u &  ./bench -c 16 -u /api/menu/list
+
+   req/s of a release build with 100 dishes, 5 s a run, on a virtual
+   machine with a single core; mixed is -c 24 of /api/menu/list beside
+   -c 8 of /api/menu/mod on one dish
+
+     -w   read-only   mixed list + mod
+      1     43566      34061 + 10206
+      2     38792      33916 + 10171
+      4     37683      26468 +  8219
+
+   one core leaves the workers nothing to run side by side, every extra
+   one only adds handoffs, so these show the cost of the pool rather
+   than its scaling; no host with more cores was at hand, so instead
+   the cpu time of each server thread out of /proc/PID/task/TID/stat
+   over the same runs, per request
+
+     -w   read-only            mixed
+          loop   the others    loop   the others
+      1   10-12    3           8-9      3
+      2   10-11    3-4         9        4
+      4   10-12    4-5         9        4-5
+
+   the others are the workers; the event loop that parses and sends
+   does three quarters of the work and stays on one thread, so on any
+   number of cores the pool tops out near (12 + 4) / 12 of one core, a
+   third more; past that the event loops themselves have to multiply,
+   with -r  */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUF_SIZE (1 << 20)
+
+typedef struct
+{
+  pthread_t thread;
+  uint64_t reqs;
+  uint64_t errs;
+  uint64_t total_us;
+  uint64_t max_us;
+} worker_t;
+
+static const char *host = "127.0.0.1";
+static int port = 8000;
+static const char *uri = "/api/menu/list";
+static const char *body = "{}";
+static unsigned seconds = 5;
+
+static char request[4096];
+static size_t request_len;
+static volatile bool running = true;
+
+static inline uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+connect_to (void)
+{
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  int one = 1;
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons (port) };
+  inet_pton (AF_INET, host, &addr.sin_addr);
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+/* read one whole response, sized by Content-Length or chunked, a long
+   chunked body only keeps its tail in BUF */
+static bool
+read_reply (int fd, char *buf)
+{
+  size_t len = 0, need = 0;
+  bool chunked = false, ok = false;
+
+  for (;;)
+    {
+      ssize_t ret = read (fd, buf + len, BUF_SIZE - 1 - len);
+      if (ret <= 0)
+	return false;
+      len += ret;
+      buf[len] = '\0';
+
+      if (!need && !chunked)
+	{
+	  char *end = strstr (buf, "\r\n\r\n");
+	  if (!end)
+	    continue;
+
+	  ok = strncmp (buf, "HTTP/1.1 200", 12) == 0;
+	  char *te = strcasestr (buf, "Transfer-Encoding: chunked");
+	  char *cl = strcasestr (buf, "Content-Length:");
+
+	  if (te && te < end)
+	    chunked = true;
+	  else if (!cl || cl > end)
+	    return false;
+	  else
+	    need = end + 4 - buf + strtoul (cl + 15, NULL, 10);
+
+	  if (need >= BUF_SIZE)
+	    return false;
+	}
+
+      /* json never carries a raw line break, so this is the last chunk */
+      if (chunked && len >= 7
+	  && !memcmp (buf + len - 7, "\r\n0\r\n\r\n", 7))
+	return ok;
+      if (chunked && len > BUF_SIZE / 2)
+	{
+	  memmove (buf, buf + len - 7, 7);
+	  len = 7;
+	}
+
+      if (need && len >= need)
+	return ok;
+    }
+}
+
+static void *
+run (void *arg)
+{
+  worker_t *w = arg;
+  char *buf = malloc (BUF_SIZE);
+  int fd = connect_to ();
+
+  while (buf && running)
+    {
+      if (fd < 0 && (fd = connect_to ()) < 0)
+	{
+	  w->errs++;
+	  usleep (1000);
+	  continue;
+	}
+
+      uint64_t start = now_us ();
+      if (write (fd, request, request_len) != (ssize_t) request_len
+	  || !read_reply (fd, buf))
+	{
+	  w->errs++;
+	  close (fd);
+	  fd = -1;
+	  continue;
+	}
+
+      uint64_t lat = now_us () - start;
+      w->reqs++;
+      w->total_us += lat;
+      if (lat > w->max_us)
+	w->max_us = lat;
+    }
+
+  if (fd >= 0)
+    close (fd);
+  free (buf);
+  return NULL;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "用法: %s [-c 连接数] [-d 秒数] [-u 路径] [-b 请求体]"
+		   " [-p 端口]\n",
+	   prog);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt;
+  unsigned conns = 8;
+
+  while ((opt = getopt (argc, argv, "c:d:u:b:p:")) != -1)
+    switch (opt)
+      {
+      case 'c':
+	conns = strtoul (optarg, NULL, 10);
+	break;
+      case 'd':
+	seconds = strtoul (optarg, NULL, 10);
+	break;
+      case 'u':
+	uri = optarg;
+	break;
+      case 'b':
+	body = optarg;
+	break;
+      case 'p':
+	port = atoi (optarg);
+	break;
+      default:
+	usage (argv[0]);
+      }
+
+  if (!conns || !seconds)
+    usage (argv[0]);
+
+  int len = snprintf (request, sizeof (request),
+		      "POST %s HTTP/1.1\r\nHost: %s\r\n"
+		      "Content-Type: application/json\r\n"
+		      "Content-Length: %zu\r\n\r\n%s",
+		      uri, host, strlen (body), body);
+  if (len < 0 || (size_t) len >= sizeof (request))
+    usage (argv[0]);
+  request_len = len;
+
+  worker_t *ws = calloc (conns, sizeof (worker_t));
+  if (!ws)
+    return EXIT_FAILURE;
+
+  for (unsigned i = 0; i < conns; i++)
+    if (0 != pthread_create (&ws[i].thread, NULL, run, ws + i))
+      return EXIT_FAILURE;
+
+  sleep (seconds);
+  running = false;
+
+  uint64_t reqs = 0, errs = 0, total_us = 0, max_us = 0;
+  for (unsigned i = 0; i < conns; i++)
+    {
+      pthread_join (ws[i].thread, NULL);
+      reqs += ws[i].reqs;
+      errs += ws[i].errs;
+      total_us += ws[i].total_us;
+      if (ws[i].max_us > max_us)
+	max_us = ws[i].max_us;
+    }
+
+  printf ("%s: %u 连接, %u 秒\n", uri, conns, seconds);
+  printf ("  请求 %lu, 失败 %lu, %.0f req/s\n", (unsigned long) reqs,
+	  (unsigned long) errs, (double) reqs / seconds);
+  printf ("  平均延迟 %.1f us, 最大延迟 %lu us\n",
+	  reqs ? (double) total_us / reqs : 0.0, (unsigned long) max_us);
+
+  free (ws);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,273 @@
+#include "cache.h"
+#include "arena.h"
+#include "table.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EVA_BUCKETS 1024
+#define EVA_MAX 4096
+
+/* shared by the cache and every request still sending it */
+typedef struct
+{
+  size_t ref;
+  size_t len;
+  char data[];
+} buf_t;
+
+/* VERSION is that of the table the response was built from, an entry
+   of dish ID also sits in the age list, oldest first */
+typedef struct entry_t
+{
+  struct entry_t *next;
+  struct entry_t *older;
+  struct entry_t *newer;
+  json_int_t id;
+  uint64_t version;
+  buf_t *buf;
+} entry_t;
+
+/* readers fill the cache side by side under the table read lock, so it
+   has a lock of its own */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* menu_list reads menu, and merchant, whose changes to what it shows
+   drop the entry through the view */
+static entry_t menu;
+
+/* eva_list reads the evaluations of one dish, which drop their entry
+   when they change, and student, the same way as merchant; at most
+   EVA_MAX of them, the least recently used goes first */
+static entry_t *evas[EVA_BUCKETS];
+static entry_t ages = { .older = &ages, .newer = &ages };
+static size_t neva;
+
+static uint64_t hits;
+static uint64_t misses;
+
+static void
+buf_unref (void *arg)
+{
+  buf_t *buf = arg;
+  if (!__atomic_sub_fetch (&buf->ref, 1, __ATOMIC_ACQ_REL))
+    free (buf);
+}
+
+static inline buf_t *
+buf_new (const char *content, size_t len)
+{
+  buf_t *buf;
+  if (!(buf = malloc (sizeof (buf_t) + len + 1)))
+    return NULL;
+
+  buf->ref = 1;
+  buf->len = len;
+  memcpy (buf->data, content, len + 1);
+  return buf;
+}
+
+/* called with LOCK held, the request keeps its own reference until
+   arena_reset */
+static inline const char *
+entry_get (entry_t *ent, uint64_t version, size_t *len)
+{
+  if (!ent || !ent->buf || ent->version != version)
+    return NULL;
+
+  __atomic_add_fetch (&ent->buf->ref, 1, __ATOMIC_RELAXED);
+  if (!arena_defer (buf_unref, ent->buf))
+    {
+      buf_unref (ent->buf);
+      return NULL;
+    }
+
+  *len = ent->buf->len;
+  return ent->buf->data;
+}
+
+/* called with LOCK held */
+static inline void
+entry_set (entry_t *ent, uint64_t version, buf_t *buf)
+{
+  if (ent->buf)
+    buf_unref (ent->buf);
+
+  ent->version = version;
+  ent->buf = buf;
+}
+
+static inline const char *
+count (const char *content)
+{
+  __atomic_add_fetch (content ? &hits : &misses, 1, __ATOMIC_RELAXED);
+  return content;
+}
+
+static inline entry_t **
+eva_slot (json_int_t id)
+{
+  entry_t **slot = evas + ((uint64_t) id & (EVA_BUCKETS - 1));
+  while (*slot && (*slot)->id != id)
+    slot = &(*slot)->next;
+  return slot;
+}
+
+static inline void
+age_unlink (entry_t *ent)
+{
+  ent->older->newer = ent->newer;
+  ent->newer->older = ent->older;
+}
+
+static inline void
+age_append (entry_t *ent)
+{
+  ent->older = ages.older;
+  ent->newer = &ages;
+  ages.older->newer = ent;
+  ages.older = ent;
+}
+
+/* called with LOCK held */
+static inline void
+eva_free (entry_t **slot)
+{
+  entry_t *ent = *slot;
+  *slot = ent->next;
+  age_unlink (ent);
+  entry_set (ent, 0, NULL);
+  free (ent);
+  neva--;
+}
+
+const char *
+cache_menu (size_t *len)
+{
+  pthread_mutex_lock (&lock);
+  const char *content = entry_get (&menu, table_menu->version, len);
+  pthread_mutex_unlock (&lock);
+
+  return count (content);
+}
+
+/* the stored copy, NULL if there is no memory for one */
+const char *
+cache_menu_put (const char *content, size_t len)
+{
+  buf_t *buf;
+  if (!(buf = buf_new (content, len)))
+    return NULL;
+
+  uint64_t version = table_menu->version;
+
+  pthread_mutex_lock (&lock);
+  entry_set (&menu, version, buf);
+  const char *ret = entry_get (&menu, version, &len);
+  pthread_mutex_unlock (&lock);
+
+  return ret;
+}
+
+/* a merchant shown in the list changed its name or position, or left */
+void
+cache_menu_drop (void)
+{
+  pthread_mutex_lock (&lock);
+  entry_set (&menu, 0, NULL);
+  pthread_mutex_unlock (&lock);
+}
+
+const char *
+cache_eva (json_int_t id, size_t *len)
+{
+  pthread_mutex_lock (&lock);
+
+  entry_t *ent = *eva_slot (id);
+  const char *content = entry_get (ent, 0, len);
+  if (content)
+    {
+      age_unlink (ent);
+      age_append (ent);
+    }
+
+  pthread_mutex_unlock (&lock);
+  return count (content);
+}
+
+/* ID must be a dish that exists, the stored copy, NULL if there is no
+   memory for one */
+const char *
+cache_eva_put (json_int_t id, const char *content, size_t len)
+{
+  buf_t *buf;
+  if (!(buf = buf_new (content, len)))
+    return NULL;
+
+  pthread_mutex_lock (&lock);
+
+  entry_t **slot = eva_slot (id);
+  if (!*slot)
+    {
+      if (neva == EVA_MAX)
+	eva_free (eva_slot (ages.newer->id));
+
+      /* the eviction may have unlinked the chain ahead of SLOT */
+      slot = eva_slot (id);
+      if (!(*slot = calloc (1, sizeof (entry_t))))
+	{
+	  pthread_mutex_unlock (&lock);
+	  buf_unref (buf);
+	  return NULL;
+	}
+
+      (*slot)->id = id;
+      age_append (*slot);
+      neva++;
+    }
+
+  entry_set (*slot, 0, buf);
+  const char *ret = entry_get (*slot, 0, &len);
+  pthread_mutex_unlock (&lock);
+
+  return ret;
+}
+
+/* the evaluations of dish ID changed, or the name of a student who wrote
+   one, or the dish is gone */
+void
+cache_eva_drop (json_int_t id)
+{
+  pthread_mutex_lock (&lock);
+
+  entry_t **slot = eva_slot (id);
+  if (*slot)
+    eva_free (slot);
+
+  pthread_mutex_unlock (&lock);
+}
+
+/* CONTENT came from a lookup or put, for a reply that is still being
+   sent after its request ended */
+void
+cache_pin (const char *content)
+{
+  buf_t *buf = (buf_t *) (content - offsetof (buf_t, data));
+  __atomic_add_fetch (&buf->ref, 1, __ATOMIC_RELAXED);
+}
+
+void
+cache_unpin (const char *content)
+{
+  buf_unref ((buf_t *) (content - offsetof (buf_t, data)));
+}
+
+cache_stat_t
+cache_stat (void)
+{
+  return (cache_stat_t){
+    .hits = __atomic_load_n (&hits, __ATOMIC_RELAXED),
+    .misses = __atomic_load_n (&misses, __ATOMIC_RELAXED),
+  };
+}
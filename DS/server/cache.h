@@ -0,0 +1,30 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "json.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+} cache_stat_t;
+
+/* finished list responses, good until the rows behind them change, what
+   the lookups and puts return stays valid until arena_reset */
+extern const char *cache_menu (size_t *len);
+extern const char *cache_menu_put (const char *content, size_t len);
+extern void cache_menu_drop (void);
+
+extern const char *cache_eva (json_int_t id, size_t *len);
+extern const char *cache_eva_put (json_int_t id, const char *content,
+				  size_t len);
+extern void cache_eva_drop (json_int_t id);
+
+extern void cache_pin (const char *content);
+extern void cache_unpin (const char *content);
+
+extern cache_stat_t cache_stat (void);
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* the json layer of the tables and the api, implemented by json_simd.c
+   or json_jansson.c as JSON in the Makefile selects; everything either
+   one hands out lives in the calling thread's arena */
+
+/* the integer type of jansson, so both backends store the same columns */
+typedef long long json_int_t;
+
+/* a value as it stands in the input, to be decoded on its own later */
+typedef struct
+{
+  char *buf;
+  size_t len;
+} json_span_t;
+
+typedef enum
+{
+  JSON_STR, /* const char *, nul terminated */
+  JSON_INT, /* json_int_t, a number without fraction or exponent */
+  JSON_NUM, /* double, any number */
+  JSON_RAW, /* json_span_t, any value left undecoded */
+} json_kind_t;
+
+/* one member an object must carry, stored at OFF of the output */
+typedef struct
+{
+  const char *key;
+  size_t len;
+  json_kind_t kind;
+  size_t off;
+} json_field_t;
+
+#define JSON_FIELDS_MAX 32
+
+enum
+{
+  JSON_OK,
+  JSON_BAD,
+  JSON_MISSING,
+};
+
+/* writes one document value by value, members in the order given */
+typedef struct json_out json_out_t;
+
+extern void json_init (void);
+
+extern int json_decode (char *buf, size_t len, const json_field_t *fields,
+			size_t num, void *out);
+extern int json_items (char *buf, size_t len, json_span_t **items,
+		       size_t *num);
+
+extern json_out_t *json_out_new (void);
+extern json_out_t *json_out_file (FILE *file);
+
+extern void json_out_obj (json_out_t *out);
+extern void json_out_arr (json_out_t *out);
+extern void json_out_end (json_out_t *out);
+extern void json_out_key (json_out_t *out, const char *key);
+extern void json_out_int (json_out_t *out, json_int_t val);
+extern void json_out_num (json_out_t *out, double val);
+extern void json_out_str (json_out_t *out, const char *str, size_t len);
+extern void json_out_raw (json_out_t *out, const char *str, size_t len);
+
+extern char *json_out_done (json_out_t *out, size_t *len);
+extern bool json_out_flush (json_out_t *out);
+
+#endif
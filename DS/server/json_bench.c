@@ -0,0 +1,447 @@
+/* parse and serialize speed of the json backend on the table files, e.g.
+   export the tables once and compare the backends with
+
+     ./server -e
+     make -B json_bench MODE=release JSON=simd
+     ./json_bench data/menu.json data/evaluation.json
+     make -B json_bench MODE=release JSON=jansson
+     ./json_bench data/menu.json data/evaluation.json
+
+   parsing decodes every row into its columns as table_init does, output
+   renders every row on its own as the replies do and the whole table
+   indented as table_export does
+
+   with -c it checks instead that every row written out decodes back to
+   the same columns, and prints the columns in a form that does not
+   depend on the backend; make json_check compares the two backends so */
+
+#define _GNU_SOURCE
+
+#include "arena.h"
+#include "json.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_COLS 8
+
+/* the columns of table.c, found by the file name */
+typedef struct
+{
+  const char *name;
+  size_t ncol;
+  json_field_t cols[BENCH_COLS];
+} schema_t;
+
+typedef union
+{
+  json_int_t ival;
+  double nval;
+  const char *sval;
+} val_t;
+
+#define COL(KEY, KIND, POS)                                                   \
+  { .key = (KEY),                                                             \
+    .len = sizeof (KEY) - 1,                                                  \
+    .kind = JSON_##KIND,                                                      \
+    .off = (POS) * sizeof (val_t) }
+
+static const schema_t schemas[] = {
+  { "menu", 4,
+    { COL ("id", INT, 0), COL ("name", STR, 1), COL ("user", STR, 2),
+      COL ("price", NUM, 3) } },
+  { "student", 5,
+    { COL ("id", STR, 0), COL ("user", STR, 1), COL ("pass", STR, 2),
+      COL ("name", STR, 3), COL ("number", STR, 4) } },
+  { "merchant", 5,
+    { COL ("user", STR, 0), COL ("pass", STR, 1), COL ("name", STR, 2),
+      COL ("number", STR, 3), COL ("position", STR, 4) } },
+  { "evaluation", 4,
+    { COL ("id", INT, 0), COL ("user", STR, 1), COL ("grade", NUM, 2),
+      COL ("evaluation", STR, 3) } },
+};
+
+typedef struct
+{
+  size_t off;
+  size_t len;
+} span_t;
+
+static unsigned rounds = 10;
+static bool check = false;
+
+/* the export goes nowhere, only its size is kept */
+static size_t sunk;
+
+static ssize_t
+sink_write (void *cookie, const char *buf, size_t len)
+{
+  (void) cookie;
+  (void) buf;
+  sunk += len;
+  return len;
+}
+
+static inline uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const schema_t *
+schema_find (const char *path)
+{
+  const char *base = strrchr (path, '/');
+  base = base ? base + 1 : path;
+
+  for (size_t i = 0; i < sizeof (schemas) / sizeof (*schemas); i++)
+    {
+      size_t len = strlen (schemas[i].name);
+      if (!strncmp (base, schemas[i].name, len) && base[len] == '.')
+	return schemas + i;
+    }
+  return NULL;
+}
+
+static char *
+file_read (const char *path, size_t *len)
+{
+  FILE *file = fopen (path, "r");
+  if (!file)
+    return NULL;
+
+  char *buf = NULL;
+  size_t cap = 0, num;
+  *len = 0;
+
+  do
+    {
+      if (*len == cap)
+	{
+	  cap = cap ? cap * 2 : 65536;
+	  char *temp;
+	  if (!(temp = realloc (buf, cap)))
+	    {
+	      free (buf);
+	      fclose (file);
+	      return NULL;
+	    }
+	  buf = temp;
+	}
+      num = fread (buf + *len, 1, cap - *len, file);
+      *len += num;
+    }
+  while (num);
+
+  fclose (file);
+  return buf;
+}
+
+/* the objects of the top-level array, as table.c's reader cuts them */
+static span_t *
+rows_split (const char *buf, size_t len, size_t *num)
+{
+  size_t cap = 1024, start = 0;
+  span_t *rows = malloc (cap * sizeof (span_t));
+  int depth = 0;
+  bool str = false, esc = false;
+
+  *num = 0;
+  for (size_t i = 0; rows && i < len; i++)
+    {
+      char c = buf[i];
+
+      if (str)
+	{
+	  if (esc)
+	    esc = false;
+	  else if (c == '\\')
+	    esc = true;
+	  else if (c == '"')
+	    str = false;
+	  continue;
+	}
+
+      if (c == '"')
+	str = true;
+      else if (c == '{' || c == '[')
+	{
+	  if (c == '{' && depth == 1)
+	    start = i;
+	  depth++;
+	}
+      else if ((c == '}' || c == ']') && --depth == 1 && c == '}')
+	{
+	  if (*num == cap)
+	    {
+	      cap *= 2;
+	      span_t *temp;
+	      if (!(temp = realloc (rows, cap * sizeof (span_t))))
+		{
+		  free (rows);
+		  return NULL;
+		}
+	      rows = temp;
+	    }
+	  rows[(*num)++] = (span_t){ .off = start, .len = i + 1 - start };
+	}
+    }
+
+  return rows;
+}
+
+static inline void
+row_out (json_out_t *out, const schema_t *sch, const val_t *vals)
+{
+  json_out_obj (out);
+  for (size_t j = 0; j < sch->ncol; j++)
+    {
+      const json_field_t *col = sch->cols + j;
+      json_out_key (out, col->key);
+
+      if (col->kind == JSON_INT)
+	json_out_int (out, vals[j].ival);
+      else if (col->kind == JSON_NUM)
+	json_out_num (out, vals[j].nval);
+      else
+	json_out_str (out, vals[j].sval, strlen (vals[j].sval));
+    }
+  json_out_end (out);
+}
+
+static inline bool
+val_same (json_kind_t kind, val_t a, val_t b)
+{
+  if (kind == JSON_INT)
+    return a.ival == b.ival;
+  if (kind == JSON_NUM)
+    return !memcmp (&a.nval, &b.nval, sizeof (double));
+  return !strcmp (a.sval, b.sval);
+}
+
+/* every row written out on its own and decoded again, then the columns
+   on stdout, one row a line: integers in decimal, numbers in hex so
+   that no digit is lost, strings behind their length */
+static bool
+round_trip (const char *path, const schema_t *sch, const val_t *vals,
+	    size_t num)
+{
+  val_t tmp[BENCH_COLS];
+
+  for (size_t i = 0; i < num; i++)
+    {
+      const val_t *row = vals + i * sch->ncol;
+      json_out_t *out;
+      char *str;
+      size_t len;
+
+      if (!(out = json_out_new ()))
+	return false;
+      row_out (out, sch, row);
+      if (!(str = json_out_done (out, &len)))
+	return false;
+
+      if (json_decode (str, len, sch->cols, sch->ncol, tmp) != JSON_OK)
+	{
+	  fprintf (stderr, "%s: 第 %zu 行输出后无法解析\n", path, i);
+	  return false;
+	}
+
+      for (size_t j = 0; j < sch->ncol; j++)
+	if (!val_same (sch->cols[j].kind, row[j], tmp[j]))
+	  {
+	    fprintf (stderr, "%s: 第 %zu 行 %s 列往返后不同\n", path, i,
+		     sch->cols[j].key);
+	    return false;
+	  }
+
+      arena_reset ();
+    }
+
+  printf ("%s\n", sch->name);
+  for (size_t i = 0; i < num * sch->ncol; i++)
+    {
+      const json_field_t *col = sch->cols + i % sch->ncol;
+
+      if (col->kind == JSON_INT)
+	printf ("%lld", vals[i].ival);
+      else if (col->kind == JSON_NUM)
+	printf ("%a", vals[i].nval);
+      else
+	printf ("%zu:%s", strlen (vals[i].sval), vals[i].sval);
+
+      putchar ((i + 1) % sch->ncol ? '\t' : '\n');
+    }
+
+  return true;
+}
+
+static inline double
+rate (size_t bytes, uint64_t us)
+{
+  return us ? bytes / (double) us : 0;
+}
+
+static bool
+bench (const char *path)
+{
+  const schema_t *sch;
+  if (!(sch = schema_find (path)))
+    {
+      fprintf (stderr, "%s: 未知数据表\n", path);
+      return false;
+    }
+
+  size_t len, num;
+  char *buf = file_read (path, &len);
+  span_t *rows = buf ? rows_split (buf, len, &num) : NULL;
+  val_t *vals = rows ? calloc (num * sch->ncol + 1, sizeof (val_t)) : NULL;
+  char *scratch = vals ? malloc (len + 1) : NULL;
+  cookie_io_functions_t sink = { .write = sink_write };
+  FILE *null = scratch ? fopencookie (NULL, "w", sink) : NULL;
+
+  if (!null)
+    {
+      fprintf (stderr, "%s: 读取失败\n", path);
+      return false;
+    }
+
+  /* the columns are kept for the output rounds, strings in SCRATCH */
+  for (size_t i = 0; i < num; i++)
+    {
+      char *row = scratch + rows[i].off;
+      memcpy (row, buf + rows[i].off, rows[i].len);
+
+      if (json_decode (row, rows[i].len, sch->cols, sch->ncol,
+		       vals + i * sch->ncol)
+	  != JSON_OK)
+	{
+	  fprintf (stderr, "%s: 第 %zu 行解析失败\n", path, i);
+	  return false;
+	}
+    }
+
+  /* strings a backend decoded into the arena are copied out of it */
+  for (size_t i = 0; i < num * sch->ncol; i++)
+    if (sch->cols[i % sch->ncol].kind == JSON_STR
+	&& !(vals[i].sval = strdup (vals[i].sval)))
+      return false;
+  arena_reset ();
+
+  bool ok = true;
+  char *row = NULL;
+
+  if (check)
+    {
+      ok = round_trip (path, sch, vals, num);
+      goto done;
+    }
+
+  size_t in = 0, one = 0, all = 0;
+  uint64_t parse_us = 0, one_us = 0, all_us = 0;
+  val_t tmp[BENCH_COLS];
+
+  row = malloc (len + 1);
+
+  for (unsigned r = 0; r < rounds && row; r++)
+    {
+      uint64_t start = now_us ();
+      for (size_t i = 0; i < num; i++)
+	{
+	  memcpy (row, buf + rows[i].off, rows[i].len);
+	  json_decode (row, rows[i].len, sch->cols, sch->ncol, tmp);
+	  in += rows[i].len;
+	  arena_reset ();
+	}
+      parse_us += now_us () - start;
+
+      start = now_us ();
+      for (size_t i = 0; i < num; i++)
+	{
+	  json_out_t *out = json_out_new ();
+	  size_t olen;
+
+	  row_out (out, sch, vals + i * sch->ncol);
+	  if (json_out_done (out, &olen))
+	    one += olen;
+	  if (i % 1024 == 0)
+	    arena_reset ();
+	}
+      arena_reset ();
+      one_us += now_us () - start;
+
+      start = now_us ();
+      size_t from = sunk;
+      json_out_t *out = json_out_file (null);
+      json_out_arr (out);
+      for (size_t i = 0; i < num; i++)
+	row_out (out, sch, vals + i * sch->ncol);
+      json_out_end (out);
+      json_out_flush (out);
+      all += sunk - from;
+      arena_reset ();
+      all_us += now_us () - start;
+    }
+
+  printf ("%s: %zu 行, %.1f MB, %u 轮\n", path, num, len / 1e6, rounds);
+  printf ("  解析 %.1f MB/s\n", rate (in, parse_us));
+  printf ("  单行输出 %.1f MB/s, 导出 %.1f MB/s\n", rate (one, one_us),
+	  rate (all, all_us));
+
+done:
+  for (size_t i = 0; i < num * sch->ncol; i++)
+    if (sch->cols[i % sch->ncol].kind == JSON_STR)
+      free ((char *) vals[i].sval);
+
+  fclose (null);
+  free (row);
+  free (scratch);
+  free (vals);
+  free (rows);
+  free (buf);
+  return ok;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "用法: %s [-n 轮数] [-c] 数据表文件...\n", prog);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt (argc, argv, "n:c")) != -1)
+    switch (opt)
+      {
+      case 'n':
+	rounds = strtoul (optarg, NULL, 10);
+	break;
+      case 'c':
+	check = true;
+	break;
+      default:
+	usage (argv[0]);
+      }
+
+  if (optind == argc || !rounds)
+    usage (argv[0]);
+
+  json_init ();
+
+  bool ok = true;
+  for (int i = optind; i < argc; i++)
+    ok = bench (argv[i]) && ok;
+
+  arena_release ();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,227 @@
+#include "json.h"
+#include "arena.h"
+
+#include <jansson.h>
+#include <string.h>
+
+/* every tree lives in the arena, freeing one is left to arena_reset */
+void
+json_init (void)
+{
+  json_set_alloc_funcs (arena_alloc, arena_free);
+}
+
+/* the tree is never released, so the strings stored into OUT stay valid
+   until arena_reset like those of json_simd.c */
+int
+json_decode (char *buf, size_t len, const json_field_t *fields, size_t num,
+	     void *out)
+{
+  json_error_t jerr;
+  json_t *root;
+
+  if (!(root = json_loadb (buf, len, 0, &jerr)))
+    return JSON_BAD;
+
+  for (size_t i = 0; i < num; i++)
+    {
+      const json_field_t *field = fields + i;
+      json_t *val = json_object_get (root, field->key);
+      char *dst = (char *) out + field->off;
+
+      if (field->kind == JSON_STR && json_is_string (val))
+	*(const char **) dst = json_string_value (val);
+      else if (field->kind == JSON_INT && json_is_integer (val))
+	*(json_int_t *) dst = json_integer_value (val);
+      else if (field->kind == JSON_NUM && json_is_number (val))
+	*(double *) dst = json_number_value (val);
+      else if (field->kind == JSON_RAW && val)
+	{
+	  json_span_t *span = (json_span_t *) dst;
+	  if (!(span->buf = json_dumps (val, JSON_ENCODE_ANY)))
+	    return JSON_BAD;
+	  span->len = strlen (span->buf);
+	}
+      else
+	return JSON_MISSING;
+    }
+
+  return JSON_OK;
+}
+
+/* every element is printed again on its own, into the arena as well */
+int
+json_items (char *buf, size_t len, json_span_t **items, size_t *num)
+{
+  json_error_t jerr;
+  json_t *root;
+
+  if (!(root = json_loadb (buf, len, 0, &jerr)) || !json_is_array (root))
+    return JSON_BAD;
+
+  *num = json_array_size (root);
+  if (!(*items = arena_alloc ((*num + 1) * sizeof (json_span_t))))
+    return JSON_BAD;
+
+  for (size_t i = 0; i < *num; i++)
+    {
+      json_span_t *span = *items + i;
+      if (!(span->buf = json_dumps (json_array_get (root, i),
+				    JSON_ENCODE_ANY)))
+	return JSON_BAD;
+      span->len = strlen (span->buf);
+    }
+
+  return JSON_OK;
+}
+
+/* the open containers, and the key the next value is set under */
+struct json_out
+{
+  json_t *root;
+  json_t *stack[64];
+  unsigned depth;
+  const char *key;
+  FILE *file;
+  bool fail;
+};
+
+json_out_t *
+json_out_new (void)
+{
+  json_out_t *out;
+  if (!(out = arena_alloc (sizeof (json_out_t))))
+    return NULL;
+
+  *out = (json_out_t){ .root = NULL };
+  return out;
+}
+
+json_out_t *
+json_out_file (FILE *file)
+{
+  json_out_t *out;
+  if ((out = json_out_new ()))
+    out->file = file;
+  return out;
+}
+
+/* VAL is consumed, it becomes the root or joins the open container */
+static inline void
+out_add (json_out_t *out, json_t *val)
+{
+  if (!val)
+    {
+      out->fail = true;
+      return;
+    }
+
+  if (!out->depth)
+    {
+      if (out->root)
+	out->fail = true;
+      out->root = val;
+      return;
+    }
+
+  json_t *top = out->stack[out->depth - 1];
+  int ret = -1;
+
+  if (json_is_array (top))
+    ret = json_array_append_new (top, val);
+  else if (out->key)
+    ret = json_object_set_new (top, out->key, val);
+  else
+    json_decref (val);
+
+  out->key = NULL;
+  if (ret != 0)
+    out->fail = true;
+}
+
+static inline void
+out_open (json_out_t *out, json_t *val)
+{
+  if (out->depth == sizeof (out->stack) / sizeof (*out->stack))
+    {
+      out->fail = true;
+      return;
+    }
+
+  out_add (out, val);
+  if (!out->fail)
+    out->stack[out->depth++] = val;
+}
+
+void
+json_out_obj (json_out_t *out)
+{
+  out_open (out, json_object ());
+}
+
+void
+json_out_arr (json_out_t *out)
+{
+  out_open (out, json_array ());
+}
+
+void
+json_out_end (json_out_t *out)
+{
+  if (!out->depth || out->key)
+    out->fail = true;
+  else
+    out->depth--;
+}
+
+void
+json_out_key (json_out_t *out, const char *key)
+{
+  out->key = key;
+}
+
+void
+json_out_int (json_out_t *out, json_int_t val)
+{
+  out_add (out, json_integer (val));
+}
+
+void
+json_out_num (json_out_t *out, double val)
+{
+  out_add (out, json_real (val));
+}
+
+void
+json_out_str (json_out_t *out, const char *str, size_t len)
+{
+  out_add (out, json_stringn (str, len));
+}
+
+/* STR is a value in json already, it joins the tree loaded */
+void
+json_out_raw (json_out_t *out, const char *str, size_t len)
+{
+  json_error_t jerr;
+  out_add (out, json_loadb (str, len, JSON_DECODE_ANY, &jerr));
+}
+
+char *
+json_out_done (json_out_t *out, size_t *len)
+{
+  char *str;
+  if (out->fail || out->depth || !out->root
+      || !(str = json_dumps (out->root, 0)))
+    return NULL;
+
+  *len = strlen (str);
+  return str;
+}
+
+bool
+json_out_flush (json_out_t *out)
+{
+  return !out->fail && !out->depth && out->root
+	 && json_dumpf (out->root, out->file, JSON_INDENT (2)) == 0
+	 && fflush (out->file) == 0;
+}
@@ -0,0 +1,1009 @@
+#include "json.h"
+#include "arena.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* nesting allowed in members nobody asked for, the same as jansson */
+#define JSON_DEPTH 2048
+
+#define DIGIT(C) ((C) >= '0' && (C) <= '9')
+
+/* KEEP is set while a raw value is walked, which has to stay as it is */
+typedef struct
+{
+  char *pos;
+  char *end;
+  bool keep;
+} cur_t;
+
+enum
+{
+  VAL_STR,
+  VAL_INT,
+  VAL_NUM,
+  VAL_OTHER,
+};
+
+typedef struct
+{
+  int kind;
+  char *str;
+  json_int_t ival;
+  double nval;
+  json_span_t span;
+} val_t;
+
+static bool read_value (cur_t *cur, unsigned depth, val_t *val);
+
+static inline void
+skip_ws (cur_t *cur)
+{
+  while (cur->pos < cur->end
+	 && (*cur->pos == ' ' || *cur->pos == '\t' || *cur->pos == '\n'
+	     || *cur->pos == '\r'))
+    cur->pos++;
+}
+
+static inline bool
+skip_char (cur_t *cur, char c)
+{
+  skip_ws (cur);
+  if (cur->pos == cur->end || *cur->pos != c)
+    return false;
+  cur->pos++;
+  skip_ws (cur);
+  return true;
+}
+
+static inline bool
+read_lit (cur_t *cur, const char *lit, size_t len)
+{
+  if ((size_t) (cur->end - cur->pos) < len || memcmp (cur->pos, lit, len))
+    return false;
+  cur->pos += len;
+  return true;
+}
+
+static inline bool
+read_hex (cur_t *cur, unsigned *val)
+{
+  if (cur->end - cur->pos < 4)
+    return false;
+
+  unsigned ret = 0;
+  for (int i = 0; i < 4; i++)
+    {
+      char c = *cur->pos++;
+      if (DIGIT (c))
+	ret = ret << 4 | (c - '0');
+      else if (c >= 'a' && c <= 'f')
+	ret = ret << 4 | (c - 'a' + 10);
+      else if (c >= 'A' && c <= 'F')
+	ret = ret << 4 | (c - 'A' + 10);
+      else
+	return false;
+    }
+
+  *val = ret;
+  return true;
+}
+
+static inline char *
+utf8_put (char *dst, unsigned cp)
+{
+  if (cp < 0x80)
+    *dst++ = cp;
+  else if (cp < 0x800)
+    {
+      *dst++ = 0xc0 | cp >> 6;
+      *dst++ = 0x80 | (cp & 0x3f);
+    }
+  else if (cp < 0x10000)
+    {
+      *dst++ = 0xe0 | cp >> 12;
+      *dst++ = 0x80 | (cp >> 6 & 0x3f);
+      *dst++ = 0x80 | (cp & 0x3f);
+    }
+  else
+    {
+      *dst++ = 0xf0 | cp >> 18;
+      *dst++ = 0x80 | (cp >> 12 & 0x3f);
+      *dst++ = 0x80 | (cp >> 6 & 0x3f);
+      *dst++ = 0x80 | (cp & 0x3f);
+    }
+  return dst;
+}
+
+/* length of the well formed utf-8 sequence at POS, 0 if there is none */
+static inline size_t
+utf8_len (const unsigned char *pos, const unsigned char *end)
+{
+  unsigned c = *pos, cp;
+  size_t len;
+
+  if (c < 0x80)
+    return 1;
+  else if (c >= 0xc2 && c <= 0xdf)
+    len = 2, cp = c & 0x1f;
+  else if (c >= 0xe0 && c <= 0xef)
+    len = 3, cp = c & 0x0f;
+  else if (c >= 0xf0 && c <= 0xf4)
+    len = 4, cp = c & 0x07;
+  else
+    return 0;
+
+  if ((size_t) (end - pos) < len)
+    return 0;
+
+  for (size_t i = 1; i < len; i++)
+    {
+      if ((pos[i] & 0xc0) != 0x80)
+	return 0;
+      cp = cp << 6 | (pos[i] & 0x3f);
+    }
+
+  if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000)
+      || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+    return 0;
+  return len;
+}
+
+/* the escape at the cursor, its output is never longer than its source */
+static inline bool
+read_esc (cur_t *cur, char **dst)
+{
+  if (cur->end - cur->pos < 2)
+    return false;
+
+  char c = cur->pos[1];
+  cur->pos += 2;
+
+  switch (c)
+    {
+    case '"':
+    case '\\':
+    case '/':
+      *(*dst)++ = c;
+      return true;
+    case 'b':
+      *(*dst)++ = '\b';
+      return true;
+    case 'f':
+      *(*dst)++ = '\f';
+      return true;
+    case 'n':
+      *(*dst)++ = '\n';
+      return true;
+    case 'r':
+      *(*dst)++ = '\r';
+      return true;
+    case 't':
+      *(*dst)++ = '\t';
+      return true;
+    case 'u':
+      break;
+    default:
+      return false;
+    }
+
+  unsigned cp, lo;
+  if (!read_hex (cur, &cp) || (cp >= 0xdc00 && cp <= 0xdfff))
+    return false;
+
+  if (cp >= 0xd800 && cp <= 0xdbff)
+    {
+      if (!read_lit (cur, "\\u", 2) || !read_hex (cur, &lo) || lo < 0xdc00
+	  || lo > 0xdfff)
+	return false;
+      cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+    }
+
+  /* \u0000 would cut the string short */
+  if (!cp)
+    return false;
+
+  *dst = utf8_put (*dst, cp);
+  return true;
+}
+
+/* moves the plain ascii at the cursor down to DST sixteen bytes at a
+   time and stops at the first byte read_str has to look at */
+static inline char *
+read_run (cur_t *cur, char *dst)
+{
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i slash = _mm_set1_epi8 ('\\');
+  const __m128i space = _mm_set1_epi8 (' ');
+
+  while (cur->end - cur->pos >= 16)
+    {
+      /* a signed compare takes control and non-ascii bytes at once */
+      __m128i vec = _mm_loadu_si128 ((const __m128i *) cur->pos);
+      __m128i hit = _mm_or_si128 (_mm_cmpeq_epi8 (vec, quote),
+				  _mm_cmpeq_epi8 (vec, slash));
+      unsigned mask
+	  = _mm_movemask_epi8 (_mm_or_si128 (hit, _mm_cmplt_epi8 (vec, space)));
+
+      if (!mask)
+	{
+	  if (dst != cur->pos)
+	    _mm_storeu_si128 ((__m128i *) dst, vec);
+	  dst += 16;
+	  cur->pos += 16;
+	  continue;
+	}
+
+      size_t num = __builtin_ctz (mask);
+      if (dst != cur->pos)
+	memmove (dst, cur->pos, num);
+      dst += num;
+      cur->pos += num;
+      break;
+    }
+#endif
+  return dst;
+}
+
+/* checks the string at the cursor as read_str does, without a write */
+static bool
+skip_str (cur_t *cur)
+{
+  cur->pos++;
+
+  for (;;)
+    {
+      read_run (cur, cur->pos);
+      if (cur->pos == cur->end)
+	return false;
+
+      unsigned char c = *cur->pos;
+
+      if (c == '"')
+	{
+	  cur->pos++;
+	  return true;
+	}
+
+      if (c < 0x20)
+	return false;
+
+      if (c == '\\')
+	{
+	  char tmp[4], *dst = tmp;
+	  if (!read_esc (cur, &dst))
+	    return false;
+	  continue;
+	}
+
+      size_t num = utf8_len ((unsigned char *) cur->pos,
+			     (unsigned char *) cur->end);
+      if (!num)
+	return false;
+      cur->pos += num;
+    }
+}
+
+/* decodes the string at the cursor onto itself and terminates it where
+   it ends, the closing quote is always free to take the nul */
+static bool
+read_str (cur_t *cur, char **str, size_t *len)
+{
+  if (cur->keep)
+    {
+      *str = NULL;
+      *len = 0;
+      return skip_str (cur);
+    }
+
+  char *dst = ++cur->pos;
+  *str = dst;
+
+  for (;;)
+    {
+      dst = read_run (cur, dst);
+      if (cur->pos == cur->end)
+	return false;
+
+      unsigned char c = *cur->pos;
+
+      if (c == '"')
+	{
+	  *len = dst - *str;
+	  *dst = '\0';
+	  cur->pos++;
+	  return true;
+	}
+
+      if (c < 0x20)
+	return false;
+
+      if (c == '\\')
+	{
+	  if (!read_esc (cur, &dst))
+	    return false;
+	  continue;
+	}
+
+      size_t num = utf8_len ((unsigned char *) cur->pos,
+			     (unsigned char *) cur->end);
+      if (!num)
+	return false;
+
+      if (dst == cur->pos)
+	dst += num;
+      else
+	for (size_t i = 0; i < num; i++)
+	  *dst++ = cur->pos[i];
+      cur->pos += num;
+    }
+}
+
+/* a number as json spells it, VAL_INT without fraction and exponent;
+   integers out of range are rejected like jansson does */
+static bool
+read_num (cur_t *cur, val_t *val)
+{
+  char *pos = cur->pos, *end = cur->end;
+  bool integer = true;
+
+  if (pos < end && *pos == '-')
+    pos++;
+  if (pos == end || !DIGIT (*pos))
+    return false;
+
+  if (*pos == '0')
+    pos++;
+  else
+    while (pos < end && DIGIT (*pos))
+      pos++;
+
+  if (pos < end && *pos == '.')
+    {
+      integer = false;
+      if (++pos == end || !DIGIT (*pos))
+	return false;
+      while (pos < end && DIGIT (*pos))
+	pos++;
+    }
+
+  if (pos < end && (*pos == 'e' || *pos == 'E'))
+    {
+      integer = false;
+      if (++pos < end && (*pos == '+' || *pos == '-'))
+	pos++;
+      if (pos == end || !DIGIT (*pos))
+	return false;
+      while (pos < end && DIGIT (*pos))
+	pos++;
+    }
+
+  /* a number only stands inside an object or array, so there is always
+     a byte behind it to terminate on for a moment */
+  if (pos == end)
+    return false;
+
+  char save = *pos;
+  *pos = '\0';
+  errno = 0;
+
+  if (integer)
+    {
+      val->kind = VAL_INT;
+      val->ival = strtoll (cur->pos, NULL, 10);
+      val->nval = val->ival;
+    }
+  else
+    {
+      val->kind = VAL_NUM;
+      val->nval = strtod (cur->pos, NULL);
+    }
+
+  *pos = save;
+  cur->pos = pos;
+
+  if (errno == ERANGE && (integer || isinf (val->nval)))
+    return false;
+  return true;
+}
+
+static inline const json_field_t *
+field_find (const json_field_t *fields, size_t num, const char *key,
+	    size_t len)
+{
+  for (size_t i = 0; i < num; i++)
+    if (fields[i].len == len && !memcmp (fields[i].key, key, len))
+      return fields + i;
+  return NULL;
+}
+
+static inline bool
+field_store (const json_field_t *field, const val_t *val, void *out)
+{
+  char *dst = (char *) out + field->off;
+
+  switch (field->kind)
+    {
+    case JSON_STR:
+      if (val->kind != VAL_STR)
+	return false;
+      *(const char **) dst = val->str;
+      return true;
+
+    case JSON_INT:
+      if (val->kind != VAL_INT)
+	return false;
+      *(json_int_t *) dst = val->ival;
+      return true;
+
+    case JSON_NUM:
+      if (val->kind != VAL_INT && val->kind != VAL_NUM)
+	return false;
+      *(double *) dst = val->nval;
+      return true;
+
+    case JSON_RAW:
+      *(json_span_t *) dst = val->span;
+      return true;
+    }
+
+  return false;
+}
+
+/* an object or array; members of the outermost object that FIELDS asks
+   for are stored into OUT as they pass by, a later duplicate wins */
+static bool
+read_nest (cur_t *cur, unsigned depth, const json_field_t *fields,
+	   size_t num, void *out, uint64_t *seen)
+{
+  bool object = *cur->pos == '{';
+  char close = object ? '}' : ']';
+
+  cur->pos++;
+  skip_ws (cur);
+  if (cur->pos < cur->end && *cur->pos == close)
+    {
+      cur->pos++;
+      return true;
+    }
+
+  for (;;)
+    {
+      char *key = NULL;
+      size_t len = 0;
+
+      if (object)
+	{
+	  if (cur->pos == cur->end || *cur->pos != '"')
+	    return false;
+	  if (!read_str (cur, &key, &len) || !skip_char (cur, ':'))
+	    return false;
+	}
+
+      const json_field_t *field = NULL;
+      if (key && fields)
+	field = field_find (fields, num, key, len);
+
+      bool keep = cur->keep;
+      if (field && field->kind == JSON_RAW)
+	cur->keep = true;
+
+      val_t val;
+      char *start = cur->pos;
+      bool ok = read_value (cur, depth, &val);
+      cur->keep = keep;
+      if (!ok)
+	return false;
+
+      if (field)
+	{
+	  val.span = (json_span_t){ .buf = start, .len = cur->pos - start };
+	  uint64_t bit = UINT64_C (1) << (field - fields);
+	  if (field_store (field, &val, out))
+	    *seen |= bit;
+	  else
+	    *seen &= ~bit;
+	}
+
+      skip_ws (cur);
+      if (cur->pos == cur->end)
+	return false;
+      if (*cur->pos++ == close)
+	return true;
+      if (cur->pos[-1] != ',')
+	return false;
+      skip_ws (cur);
+    }
+}
+
+static bool
+read_value (cur_t *cur, unsigned depth, val_t *val)
+{
+  size_t len;
+  val->kind = VAL_OTHER;
+
+  if (cur->pos == cur->end)
+    return false;
+
+  switch (*cur->pos)
+    {
+    case '"':
+      val->kind = VAL_STR;
+      return read_str (cur, &val->str, &len);
+    case '{':
+    case '[':
+      return depth < JSON_DEPTH && read_nest (cur, depth + 1, NULL, 0, NULL,
+					      NULL);
+    case 't':
+      return read_lit (cur, "true", 4);
+    case 'f':
+      return read_lit (cur, "false", 5);
+    case 'n':
+      return read_lit (cur, "null", 4);
+    default:
+      return read_num (cur, val);
+    }
+}
+
+/* one pass over BUF, which is decoded in place: the strings stored into
+   OUT point into it, so it has to outlive them. JSON_BAD is anything
+   jansson would not have loaded, JSON_MISSING a well formed body that
+   lacks one of the NUM FIELDS or has it with another type */
+int
+json_decode (char *buf, size_t len, const json_field_t *fields, size_t num,
+	     void *out)
+{
+  cur_t cur = { .pos = buf, .end = buf + len };
+  uint64_t seen = 0;
+
+  skip_ws (&cur);
+  if (cur.pos == cur.end || (*cur.pos != '{' && *cur.pos != '['))
+    return JSON_BAD;
+
+  if (!read_nest (&cur, 1, fields, num, out, &seen))
+    return JSON_BAD;
+
+  skip_ws (&cur);
+  if (cur.pos != cur.end)
+    return JSON_BAD;
+
+  return seen == (UINT64_C (1) << num) - 1 ? JSON_OK : JSON_MISSING;
+}
+
+/* the elements of the array in BUF, each one as it stands and to be
+   decoded on its own; NUM ITEMS in the arena */
+int
+json_items (char *buf, size_t len, json_span_t **items, size_t *num)
+{
+  cur_t cur = { .pos = buf, .end = buf + len, .keep = true };
+  size_t cap = 16;
+
+  *num = 0;
+  if (!(*items = arena_alloc (cap * sizeof (json_span_t))))
+    return JSON_BAD;
+
+  if (!skip_char (&cur, '['))
+    return JSON_BAD;
+
+  if (cur.pos < cur.end && *cur.pos == ']')
+    cur.pos++;
+  else
+    for (;;)
+      {
+	val_t val;
+	char *start = cur.pos;
+	if (!read_value (&cur, 1, &val))
+	  return JSON_BAD;
+
+	if (*num == cap)
+	  {
+	    json_span_t *temp;
+	    if (!(temp = arena_alloc (cap * 2 * sizeof (json_span_t))))
+	      return JSON_BAD;
+	    memcpy (temp, *items, cap * sizeof (json_span_t));
+	    *items = temp;
+	    cap *= 2;
+	  }
+	(*items)[(*num)++]
+	    = (json_span_t){ .buf = start, .len = cur.pos - start };
+
+	skip_ws (&cur);
+	if (cur.pos == cur.end)
+	  return JSON_BAD;
+	if (*cur.pos++ == ']')
+	  break;
+	if (cur.pos[-1] != ',')
+	  return JSON_BAD;
+	skip_ws (&cur);
+      }
+
+  skip_ws (&cur);
+  return cur.pos == cur.end ? JSON_OK : JSON_BAD;
+}
+
+void
+json_init (void)
+{
+}
+
+/* the output grows in the arena, or for a file is written out each time
+   the buffer fills; ARRS has a bit set for every open array */
+struct json_out
+{
+  char *buf;
+  size_t len;
+  size_t cap;
+  FILE *file;
+
+  unsigned depth;
+  uint64_t arrs;
+  bool first;
+  bool value;
+  bool fail;
+};
+
+#define OUT_INIT 256
+#define OUT_FILE 65536
+#define OUT_DEPTH 64
+#define OUT_INDENT 2
+
+static inline json_out_t *
+out_new (FILE *file, size_t cap)
+{
+  json_out_t *out;
+  if (!(out = arena_alloc (sizeof (json_out_t))))
+    return NULL;
+
+  *out = (json_out_t){ .cap = cap, .file = file };
+  if (!(out->buf = arena_alloc (cap)))
+    return NULL;
+  return out;
+}
+
+/* compact, as json_dumps prints without flags */
+json_out_t *
+json_out_new (void)
+{
+  return out_new (NULL, OUT_INIT);
+}
+
+/* indented by two, as the table files are written */
+json_out_t *
+json_out_file (FILE *file)
+{
+  return out_new (file, OUT_FILE);
+}
+
+static inline bool
+out_drain (json_out_t *out)
+{
+  if (out->len && fwrite (out->buf, 1, out->len, out->file) != out->len)
+    out->fail = true;
+  out->len = 0;
+  return !out->fail;
+}
+
+/* room for NUM more bytes, at most OUT_FILE of them */
+static inline char *
+out_room (json_out_t *out, size_t num)
+{
+  if (out->cap - out->len >= num)
+    return out->buf + out->len;
+
+  if (out->file)
+    return out_drain (out) ? out->buf : NULL;
+
+  size_t cap = out->cap * 2;
+  while (cap - out->len < num)
+    cap *= 2;
+
+  char *buf;
+  if (!(buf = arena_alloc (cap)))
+    {
+      out->fail = true;
+      return NULL;
+    }
+
+  memcpy (buf, out->buf, out->len);
+  out->buf = buf;
+  out->cap = cap;
+  return buf + out->len;
+}
+
+static inline void
+out_put (json_out_t *out, const char *src, size_t len)
+{
+  char *dst;
+
+  if (out->file && len > out->cap)
+    {
+      if (out_drain (out) && fwrite (src, 1, len, out->file) != len)
+	out->fail = true;
+      return;
+    }
+
+  if ((dst = out_room (out, len)))
+    {
+      memcpy (dst, src, len);
+      out->len += len;
+    }
+}
+
+static inline void
+out_line (json_out_t *out)
+{
+  char *dst;
+  size_t len = 1 + out->depth * OUT_INDENT;
+
+  if (!(dst = out_room (out, len)))
+    return;
+
+  dst[0] = '\n';
+  memset (dst + 1, ' ', len - 1);
+  out->len += len;
+}
+
+/* what goes between the members of a container, nothing after a key */
+static inline void
+out_sep (json_out_t *out)
+{
+  if (out->value)
+    {
+      out->value = false;
+      return;
+    }
+
+  if (!out->depth)
+    return;
+
+  if (!out->first)
+    out_put (out, out->file ? "," : ", ", out->file ? 1 : 2);
+  out->first = false;
+
+  if (out->file)
+    out_line (out);
+}
+
+static inline void
+out_open (json_out_t *out, char c, bool arr)
+{
+  out_sep (out);
+  if (out->depth == OUT_DEPTH)
+    {
+      out->fail = true;
+      return;
+    }
+
+  out_put (out, &c, 1);
+  out->arrs = arr ? out->arrs | UINT64_C (1) << out->depth
+		  : out->arrs & ~(UINT64_C (1) << out->depth);
+  out->depth++;
+  out->first = true;
+}
+
+void
+json_out_obj (json_out_t *out)
+{
+  out_open (out, '{', false);
+}
+
+void
+json_out_arr (json_out_t *out)
+{
+  out_open (out, '[', true);
+}
+
+void
+json_out_end (json_out_t *out)
+{
+  if (!out->depth || out->value)
+    {
+      out->fail = true;
+      return;
+    }
+
+  out->depth--;
+  if (!out->first && out->file)
+    out_line (out);
+
+  out_put (out, out->arrs >> out->depth & 1 ? "]" : "}", 1);
+  out->first = false;
+}
+
+/* length of the run at STR that is written as it is, sixteen bytes at
+   a time, up to a quote, a backslash or a control byte */
+static inline size_t
+out_run (const char *str, size_t len)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8 ('"');
+  const __m128i slash = _mm_set1_epi8 ('\\');
+  const __m128i ctrl = _mm_set1_epi8 (0x1f);
+
+  for (; i + 16 <= len; i += 16)
+    {
+      /* an unsigned minimum finds the control bytes but lets utf-8 by */
+      __m128i vec = _mm_loadu_si128 ((const __m128i *) (str + i));
+      __m128i hit = _mm_or_si128 (_mm_cmpeq_epi8 (vec, quote),
+				  _mm_cmpeq_epi8 (vec, slash));
+      hit = _mm_or_si128 (hit, _mm_cmpeq_epi8 (_mm_min_epu8 (vec, ctrl), vec));
+
+      unsigned mask = _mm_movemask_epi8 (hit);
+      if (mask)
+	return i + __builtin_ctz (mask);
+    }
+#endif
+
+  for (; i < len; i++)
+    {
+      unsigned char c = str[i];
+      if (c == '"' || c == '\\' || c < 0x20)
+	break;
+    }
+  return i;
+}
+
+/* escaped the way jansson does, utf-8 passes through unchanged */
+static inline void
+out_quote (json_out_t *out, const char *str, size_t len)
+{
+  static const char hex[] = "0123456789ABCDEF";
+
+  out_put (out, "\"", 1);
+  for (;;)
+    {
+      size_t run = out_run (str, len);
+      out_put (out, str, run);
+      if (run == len)
+	break;
+
+      unsigned char c = str[run];
+      char esc[6] = { '\\', c };
+      size_t num = 2;
+
+      switch (c)
+	{
+	case '"':
+	case '\\':
+	  break;
+	case '\b':
+	  esc[1] = 'b';
+	  break;
+	case '\f':
+	  esc[1] = 'f';
+	  break;
+	case '\n':
+	  esc[1] = 'n';
+	  break;
+	case '\r':
+	  esc[1] = 'r';
+	  break;
+	case '\t':
+	  esc[1] = 't';
+	  break;
+	default:
+	  memcpy (esc + 1, "u00", 3);
+	  esc[4] = hex[c >> 4];
+	  esc[5] = hex[c & 15];
+	  num = 6;
+	}
+
+      out_put (out, esc, num);
+      str += run + 1;
+      len -= run + 1;
+    }
+  out_put (out, "\"", 1);
+}
+
+void
+json_out_key (json_out_t *out, const char *key)
+{
+  if (!out->depth || out->value || out->arrs >> (out->depth - 1) & 1)
+    {
+      out->fail = true;
+      return;
+    }
+
+  out_sep (out);
+  out_quote (out, key, strlen (key));
+  out_put (out, ": ", 2);
+  out->value = true;
+}
+
+void
+json_out_int (json_out_t *out, json_int_t val)
+{
+  char tmp[24], *pos = tmp + sizeof (tmp);
+  unsigned long long num = val;
+  if (val < 0)
+    num = -num;
+
+  do
+    *--pos = '0' + num % 10;
+  while (num /= 10);
+  if (val < 0)
+    *--pos = '-';
+
+  out_sep (out);
+  out_put (out, pos, tmp + sizeof (tmp) - pos);
+}
+
+/* %.17g with a dot or exponent always present and the exponent without
+   sign or leading zeros, what jansson prints */
+void
+json_out_num (json_out_t *out, double val)
+{
+  char tmp[40];
+
+  if (!isfinite (val))
+    {
+      out->fail = true;
+      return;
+    }
+
+  int len = snprintf (tmp, sizeof (tmp) - 2, "%.17g", val);
+  if (!strchr (tmp, '.') && !strchr (tmp, 'e'))
+    {
+      memcpy (tmp + len, ".0", 3);
+      len += 2;
+    }
+
+  char *exp = strchr (tmp, 'e');
+  if (exp)
+    {
+      char *from = ++exp + 1;
+      if (*exp == '-')
+	exp++;
+      while (*from == '0')
+	from++;
+      memmove (exp, from, tmp + len + 1 - from);
+      len -= from - exp;
+    }
+
+  out_sep (out);
+  out_put (out, tmp, len);
+}
+
+void
+json_out_str (json_out_t *out, const char *str, size_t len)
+{
+  out_sep (out);
+  out_quote (out, str, len);
+}
+
+/* STR is a value in json already, copied as it is */
+void
+json_out_raw (json_out_t *out, const char *str, size_t len)
+{
+  out_sep (out);
+  out_put (out, str, len);
+}
+
+/* the document with a nul behind it, NULL if anything failed */
+char *
+json_out_done (json_out_t *out, size_t *len)
+{
+  char *end;
+  if (out->fail || out->depth || !(end = out_room (out, 1)))
+    return NULL;
+
+  *end = '\0';
+  *len = out->len;
+  return out->buf;
+}
+
+bool
+json_out_flush (json_out_t *out)
+{
+  return !out->depth && out_drain (out) && fflush (out->file) == 0;
+}
@@ -0,0 +1,862 @@
+#include "log.h"
+#include "ring.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+enum
+{
+  OP_PUT,
+  OP_DEL,
+};
+
+/* the linked requests of an async batch */
+enum
+{
+  AIO_WRITE = 1,
+  AIO_SYNC,
+  AIO_WAKE,
+};
+
+/* record: u32 body length, u32 body checksum, then the body: u8 table,
+   u8 op and the cells, all fields for a put and only the primary key for
+   a del, strings as u32 length plus NUL-terminated bytes */
+typedef struct
+{
+  uint32_t len;
+  uint32_t sum;
+} rec_head_t;
+
+typedef struct
+{
+  char *buf;
+  size_t len;
+  size_t cap;
+} rec_buf_t;
+
+static int log_fd = -1;
+static size_t log_num;
+static rec_buf_t rec;
+
+/* between log_hold and log_release the records of one request gather
+   here and reach the log with a single write */
+static struct
+{
+  bool on;
+  size_t num;
+  rec_buf_t buf;
+} hold;
+
+/* group commit: records queue up here until the flusher thread writes
+   them out with a single write and fsync */
+static struct
+{
+  bool on;
+  unsigned window;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t done;
+
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t num;
+  uint64_t since;
+
+  uint64_t lsn;
+  uint64_t synced;
+  log_stat_t stat;
+
+  void (*notify) (void *);
+  void *arg;
+
+  /* async mode: the event loop submits each batch to a ring instead of
+     a thread writing it, OUT is the batch in flight */
+  bool async;
+  ring_t ring;
+  unsigned left;
+  char *out;
+  size_t out_cap;
+  size_t out_len;
+  size_t out_num;
+  uint64_t out_lsn;
+  uint64_t out_since;
+
+  int wake_fd;
+  const void *wake_buf;
+  size_t wake_len;
+
+  /* coalesce mode: the event loop writes whatever its requests queued
+     with one write, at most once per INTERVAL ms */
+  bool coalesce;
+  unsigned interval;
+  uint64_t flushed;
+} group = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+static inline uint32_t
+checksum (const char *buf, size_t len)
+{
+  uint32_t sum = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+    sum = (sum ^ (unsigned char) buf[i]) * 16777619U;
+  return sum;
+}
+
+static inline uint64_t
+now_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline bool
+write_all (int fd, const char *buf, size_t len)
+{
+  while (len)
+    {
+      ssize_t ret = write (fd, buf, len);
+      if (ret < 0)
+	return false;
+      buf += ret;
+      len -= ret;
+    }
+  return true;
+}
+
+static inline bool
+rec_push (rec_buf_t *rb, const void *data, size_t len)
+{
+  if (rb->len + len > rb->cap)
+    {
+      size_t cap = rb->cap ? rb->cap : 256;
+      while (rb->len + len > cap)
+	cap *= 2;
+
+      char *buf = realloc (rb->buf, cap);
+      if (!buf)
+	return false;
+
+      rb->buf = buf;
+      rb->cap = cap;
+    }
+
+  memcpy (rb->buf + rb->len, data, len);
+  rb->len += len;
+  return true;
+}
+
+static inline bool
+rec_cell (rec_buf_t *rb, table_t *tbl, int col, value_t val)
+{
+  switch (tbl->fields[col].typ)
+    {
+    case TYP_INT:
+      return rec_push (rb, &val.ival, sizeof (json_int_t));
+
+    case TYP_NUM:
+      return rec_push (rb, &val.nval, sizeof (double));
+
+    case TYP_STR:
+      {
+	uint32_t len = strlen (val.sval);
+	return rec_push (rb, &len, sizeof (len))
+	       && rec_push (rb, val.sval, len + 1);
+      }
+
+    default:
+      error ("未知类型 %d", tbl->fields[col].typ);
+    }
+}
+
+/* parse one cell of COL at *POS, strings are referenced in place */
+static inline bool
+rec_value (table_t *tbl, int col, const char *body, size_t len, size_t *pos,
+	   value_t *val)
+{
+  switch (tbl->fields[col].typ)
+    {
+    case TYP_INT:
+      if (len - *pos < sizeof (json_int_t))
+	return false;
+      memcpy (&val->ival, body + *pos, sizeof (json_int_t));
+      *pos += sizeof (json_int_t);
+      return true;
+
+    case TYP_NUM:
+      if (len - *pos < sizeof (double))
+	return false;
+      memcpy (&val->nval, body + *pos, sizeof (double));
+      *pos += sizeof (double);
+      return true;
+
+    case TYP_STR:
+      {
+	uint32_t slen;
+	if (len - *pos < sizeof (slen))
+	  return false;
+	memcpy (&slen, body + *pos, sizeof (slen));
+	*pos += sizeof (slen);
+
+	if (len - *pos <= slen || body[*pos + slen] != '\0')
+	  return false;
+	val->sval = body + *pos;
+	*pos += slen + 1;
+	return true;
+      }
+
+    default:
+      error ("未知类型 %d", tbl->fields[col].typ);
+    }
+}
+
+static inline void
+log_apply (const char *body, size_t len)
+{
+  if (len < 2 || (unsigned char) body[0] >= TABLE_NUM)
+    error ("日志格式损坏");
+
+  table_t *tbl = tables + (unsigned char) body[0];
+  int op = body[1];
+
+  size_t pos = 2;
+  value_t vals[FIELD_MAX];
+  find_pair_t cnd[TABLE_KEYS];
+
+  if (op == OP_PUT)
+    {
+      for (size_t i = 0; i < tbl->nfield; i++)
+	if (!rec_value (tbl, i, body, len, &pos, vals + i))
+	  error ("日志格式损坏");
+      for (size_t i = 0; i < tbl->nkey; i++)
+	cnd[i] = (find_pair_t){ tbl->keys[i], vals[tbl->keys[i]] };
+    }
+  else if (op == OP_DEL)
+    {
+      for (size_t i = 0; i < tbl->nkey; i++)
+	{
+	  cnd[i].col = tbl->keys[i];
+	  if (!rec_value (tbl, cnd[i].col, body, len, &pos, &cnd[i].val))
+	    error ("日志格式损坏");
+	}
+    }
+  else
+    error ("日志中存在未知操作 %d", op);
+
+  if (pos != len)
+    error ("日志格式损坏");
+
+  find_ret_t find = find_by (tbl, cnd, tbl->nkey);
+
+  if (op == OP_DEL)
+    {
+      if (find.found && !table_remove (tbl, find.index))
+	error ("日志重放失败");
+    }
+  else if (!find.found)
+    {
+      if (!table_append (tbl, vals, NULL))
+	error ("日志重放失败");
+    }
+  else
+    for (size_t i = 0; i < tbl->nfield; i++)
+      if (!table_set (tbl, find.index, i, vals[i]))
+	error ("日志重放失败");
+
+  tbl->dirty = true;
+}
+
+/* a torn record at the tail is what a crash mid-append leaves behind */
+static inline void
+log_replay (int fd)
+{
+  off_t end_off = lseek (fd, 0, SEEK_END);
+  if (end_off < 0 || lseek (fd, 0, SEEK_SET) != 0)
+    error ("文件流重定位失败");
+
+  size_t size = end_off;
+  char *buf;
+  if (!(buf = malloc (size ? size : 1)))
+    error ("内存不足");
+
+  for (size_t got = 0; got < size;)
+    {
+      ssize_t ret = read (fd, buf + got, size - got);
+      if (ret <= 0)
+	error ("日志读取失败");
+      got += ret;
+    }
+
+  size_t end = 0;
+  rec_head_t head;
+
+  while (size - end >= sizeof (head))
+    {
+      memcpy (&head, buf + end, sizeof (head));
+      const char *body = buf + end + sizeof (head);
+
+      if (head.len > size - end - sizeof (head)
+	  || head.sum != checksum (body, head.len))
+	break;
+
+      log_apply (body, head.len);
+      end += sizeof (head) + head.len;
+      log_num++;
+    }
+
+  free (buf);
+
+  if (ftruncate (fd, end) != 0)
+    error ("日志截断失败");
+}
+
+/* a batch of NUM records up to LSN is on disk, group.lock is held */
+static inline void
+group_done (size_t num, uint64_t lsn, uint64_t since)
+{
+  uint64_t lat = now_us () - since;
+
+  group.synced = lsn;
+  group.stat.batches++;
+  group.stat.records += num;
+  group.stat.last_batch = num;
+  group.stat.total_us += lat;
+  group.stat.last_us = lat;
+  if (num > group.stat.max_batch)
+    group.stat.max_batch = num;
+  if (lat > group.stat.max_us)
+    group.stat.max_us = lat;
+
+  pthread_cond_broadcast (&group.done);
+}
+
+static void *
+group_run (void *arg)
+{
+  (void) arg;
+
+  char *buf = NULL;
+  size_t cap = 0;
+
+  pthread_mutex_lock (&group.lock);
+
+  for (;;)
+    {
+      while (!group.len)
+	pthread_cond_wait (&group.cond, &group.lock);
+
+      /* let the window fill up before paying for the fsync */
+      pthread_mutex_unlock (&group.lock);
+      usleep (group.window * 1000);
+      pthread_mutex_lock (&group.lock);
+
+      char *out = group.buf;
+      size_t out_cap = group.cap;
+
+      group.buf = buf;
+      group.cap = cap;
+      buf = out;
+      cap = out_cap;
+
+      size_t len = group.len;
+      size_t num = group.num;
+      uint64_t lsn = group.lsn;
+      uint64_t since = group.since;
+      group.len = group.num = 0;
+
+      pthread_mutex_unlock (&group.lock);
+
+      if (!write_all (log_fd, buf, len) || fsync (log_fd) != 0)
+	error ("日志写入失败");
+
+      pthread_mutex_lock (&group.lock);
+      group_done (num, lsn, since);
+
+      if (group.notify)
+	group.notify (group.arg);
+    }
+
+  return NULL;
+}
+
+static inline bool
+group_push (const char *str, size_t len, size_t num)
+{
+  pthread_mutex_lock (&group.lock);
+
+  if (group.len + len > group.cap)
+    {
+      size_t cap = group.cap ? group.cap : 4096;
+      while (group.len + len > cap)
+	cap *= 2;
+
+      char *buf = realloc (group.buf, cap);
+      if (!buf)
+	{
+	  pthread_mutex_unlock (&group.lock);
+	  return false;
+	}
+
+      group.buf = buf;
+      group.cap = cap;
+    }
+
+  if (!group.len)
+    group.since = now_us ();
+
+  memcpy (group.buf + group.len, str, len);
+  group.len += len;
+  group.num += num;
+  group.lsn += num;
+
+  pthread_cond_signal (&group.cond);
+  pthread_mutex_unlock (&group.lock);
+  return true;
+}
+
+/* one batch is in flight at a time, its write, fdatasync and wakeup are
+   linked so the kernel runs them in order, group.lock is held */
+static inline void
+async_submit (void)
+{
+  if (group.left || !group.len)
+    return;
+
+  char *buf = group.out;
+  size_t cap = group.out_cap;
+
+  group.out = group.buf;
+  group.out_cap = group.cap;
+  group.out_len = group.len;
+  group.out_num = group.num;
+  group.out_lsn = group.lsn;
+  group.out_since = group.since;
+
+  group.buf = buf;
+  group.cap = cap;
+  group.len = group.num = 0;
+
+  struct io_uring_sqe *write, *sync, *wake = NULL;
+  if (!(write = ring_sqe (&group.ring, AIO_WRITE))
+      || !(sync = ring_sqe (&group.ring, AIO_SYNC))
+      || (group.wake_len && !(wake = ring_sqe (&group.ring, AIO_WAKE))))
+    error ("日志写入失败");
+
+  /* the file is opened with O_APPEND, so the offset is ignored */
+  write->opcode = IORING_OP_WRITE;
+  write->fd = log_fd;
+  write->addr = (uintptr_t) group.out;
+  write->len = group.out_len;
+  write->off = -1;
+  write->flags = IOSQE_IO_LINK;
+
+  sync->opcode = IORING_OP_FSYNC;
+  sync->fd = log_fd;
+  sync->fsync_flags = IORING_FSYNC_DATASYNC;
+
+  if (wake)
+    {
+      sync->flags = IOSQE_IO_LINK;
+      wake->opcode = IORING_OP_WRITE;
+      wake->fd = group.wake_fd;
+      wake->addr = (uintptr_t) group.wake_buf;
+      wake->len = group.wake_len;
+      wake->off = -1;
+    }
+
+  group.left = wake ? 3 : 2;
+  if (!ring_submit (&group.ring, 0))
+    error ("日志写入失败");
+}
+
+/* only reads the completion ring, no syscall, group.lock is held */
+static inline void
+async_reap (void)
+{
+  for (struct io_uring_cqe *cqe; (cqe = ring_peek (&group.ring));
+       ring_next (&group.ring))
+    {
+      group.left--;
+
+      if (cqe->user_data == AIO_WRITE && cqe->res != (int) group.out_len)
+	error ("日志写入失败");
+
+      if (cqe->user_data == AIO_SYNC)
+	{
+	  if (cqe->res < 0)
+	    error ("日志同步失败");
+	  group_done (group.out_num, group.out_lsn, group.out_since);
+	}
+    }
+}
+
+/* group.lock is held */
+static inline void
+coalesce_flush (void)
+{
+  if (!group.len)
+    return;
+
+  if (!write_all (log_fd, group.buf, group.len))
+    error ("日志写入失败");
+
+  group_done (group.num, group.lsn, group.since);
+  group.len = group.num = 0;
+  group.flushed = now_us ();
+}
+
+void
+log_init (void)
+{
+  if ((log_fd = open (PATH_TABLE_LOG, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+    error ("日志 %s 打开失败", PATH_TABLE_LOG);
+
+  /* SO_REUSEPORT would let a second server share the port, the lock
+     keeps it off the same data */
+  if (flock (log_fd, LOCK_EX | LOCK_NB) != 0)
+    error ("数据目录已被其他进程使用");
+
+  /* left behind by a background snapshot that never finished, it holds
+     everything logged before the current file */
+  int old = open (PATH_TABLE_LOG_OLD, O_RDWR);
+  if (old >= 0)
+    {
+      log_replay (old);
+      close (old);
+    }
+
+  log_replay (log_fd);
+}
+
+/* wait until everything queued so far has been written and synced */
+void
+log_sync (void)
+{
+  pthread_mutex_lock (&group.lock);
+
+  while (group.synced < group.lsn)
+    if (group.coalesce)
+      coalesce_flush ();
+    else if (!group.async)
+      pthread_cond_wait (&group.done, &group.lock);
+    else
+      {
+	async_reap ();
+	async_submit ();
+	if (group.left && !ring_submit (&group.ring, 1))
+	  error ("日志同步失败");
+      }
+
+  pthread_mutex_unlock (&group.lock);
+}
+
+/* only valid once every table the log touched is on disk */
+bool
+log_reset (void)
+{
+  if (ftruncate (log_fd, 0) != 0)
+    return false;
+
+  log_num = 0;
+  return unlink (PATH_TABLE_LOG_OLD) == 0 || errno == ENOENT;
+}
+
+/* the old log still holds records of a failed snapshot, the current one
+   is moved over to its end */
+static inline bool
+rotate_append (void)
+{
+  int old = open (PATH_TABLE_LOG_OLD, O_WRONLY | O_APPEND);
+  if (old < 0)
+    return false;
+
+  char buf[65536];
+  bool ok = true;
+
+  for (off_t off = 0;;)
+    {
+      ssize_t ret = pread (log_fd, buf, sizeof (buf), off);
+      if (ret <= 0)
+	{
+	  ok = ret == 0;
+	  break;
+	}
+      if (!(ok = write_all (old, buf, ret)))
+	break;
+      off += ret;
+    }
+
+  /* a crash before the truncate replays the moved records twice, which
+     ends in the same tables */
+  ok = ok && fsync (old) == 0 && ftruncate (log_fd, 0) == 0;
+  close (old);
+  return ok;
+}
+
+static inline bool
+rotate_rename (void)
+{
+  if (rename (PATH_TABLE_LOG, PATH_TABLE_LOG_OLD) != 0)
+    return false;
+
+  int fd = open (PATH_TABLE_LOG, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0 || flock (fd, LOCK_EX | LOCK_NB) != 0)
+    {
+      if (fd >= 0)
+	close (fd);
+      rename (PATH_TABLE_LOG_OLD, PATH_TABLE_LOG);
+      return false;
+    }
+
+  close (log_fd);
+  log_fd = fd;
+  return true;
+}
+
+/* a background snapshot starts, records from here on go to a fresh log
+   and the old one stays until the snapshot is on disk, everything
+   queued must be synced already */
+bool
+log_rotate (void)
+{
+  pthread_mutex_lock (&group.lock);
+
+  bool ok = access (PATH_TABLE_LOG_OLD, F_OK) == 0 ? rotate_append ()
+						    : rotate_rename ();
+  if (ok)
+    log_num = 0;
+
+  pthread_mutex_unlock (&group.lock);
+  return ok;
+}
+
+/* the log has taken LOG_CHECKPOINT records since the last snapshot, the
+   event loop starts the next one, never the request that crossed it;
+   called under the table lock */
+bool
+log_full (void)
+{
+  return log_num >= LOG_CHECKPOINT;
+}
+
+/* the background snapshot covering the old log is on disk */
+void
+log_drop (void)
+{
+  if (unlink (PATH_TABLE_LOG_OLD) != 0 && errno != ENOENT)
+    fprintf (stderr, "旧日志删除失败\n");
+}
+
+bool
+log_group (unsigned window, void (*notify) (void *), void *arg)
+{
+  group.arg = arg;
+  group.notify = notify;
+  group.window = window;
+
+  if (0 != pthread_create (&group.thread, NULL, group_run, NULL))
+    return false;
+
+  group.on = true;
+  return true;
+}
+
+/* after each synced batch the ring writes WAKE_BUF to WAKE_FD, e.g. an
+   event loop wakeup pipe, so a loop waiting for replies gets back in */
+bool
+log_async (int wake_fd, const void *wake_buf, size_t wake_len)
+{
+  if (!ring_init (&group.ring, 8))
+    return false;
+
+  group.wake_fd = wake_fd;
+  group.wake_buf = wake_buf;
+  group.wake_len = wake_len;
+
+  group.async = true;
+  group.on = true;
+  return true;
+}
+
+/* records are only written by log_poll, replies wait for it like for
+   a group commit but without a thread or fsync */
+void
+log_coalesce (unsigned interval)
+{
+  group.interval = interval;
+  group.flushed = now_us ();
+  group.coalesce = true;
+  group.on = true;
+}
+
+/* called by the event loop once per iteration, after the requests it
+   just ran, returns how many ms it may wait before the next call, 0 when
+   replies were just released and -1 when it may wait freely */
+long
+log_poll (void)
+{
+  long wait = -1;
+
+  if (!group.async && !group.coalesce)
+    return wait;
+
+  pthread_mutex_lock (&group.lock);
+
+  if (group.async)
+    {
+      async_reap ();
+      async_submit ();
+    }
+  else if (group.len)
+    {
+      uint64_t due = group.flushed + group.interval * 1000ULL;
+      uint64_t now = now_us ();
+
+      if (now >= due)
+	{
+	  coalesce_flush ();
+	  wait = 0;
+	}
+      else
+	wait = (due - now + 999) / 1000;
+    }
+
+  pthread_mutex_unlock (&group.lock);
+  return wait;
+}
+
+uint64_t
+log_lsn (void)
+{
+  pthread_mutex_lock (&group.lock);
+  uint64_t lsn = group.lsn;
+  pthread_mutex_unlock (&group.lock);
+  return lsn;
+}
+
+uint64_t
+log_synced (void)
+{
+  pthread_mutex_lock (&group.lock);
+  if (group.async)
+    async_reap ();
+  uint64_t synced = group.synced;
+  pthread_mutex_unlock (&group.lock);
+  return synced;
+}
+
+log_stat_t
+log_stat (void)
+{
+  pthread_mutex_lock (&group.lock);
+  log_stat_t stat = group.stat;
+  pthread_mutex_unlock (&group.lock);
+  return stat;
+}
+
+/* NUM whole records in BUF */
+static inline bool
+log_emit (const char *buf, size_t len, size_t num)
+{
+  if (group.on)
+    {
+      if (!group_push (buf, len, num))
+	return false;
+    }
+  else
+    {
+      if (!write_all (log_fd, buf, len))
+	return false;
+
+      pthread_mutex_lock (&group.lock);
+      group.synced = group.lsn += num;
+      pthread_mutex_unlock (&group.lock);
+    }
+
+  log_num += num;
+  return true;
+}
+
+static inline bool
+log_write (table_t *tbl, int op, const value_t *vals)
+{
+  rec_head_t head = { .len = 0 };
+  unsigned char tag[2] = { tbl - tables, op };
+
+  rec.len = 0;
+  if (!rec_push (&rec, &head, sizeof (head)) || !rec_push (&rec, tag, 2))
+    return false;
+
+  if (op == OP_PUT)
+    {
+      for (size_t i = 0; i < tbl->nfield; i++)
+	if (!rec_cell (&rec, tbl, i, vals[i]))
+	  return false;
+    }
+  else
+    for (size_t i = 0; i < tbl->nkey; i++)
+      if (!rec_cell (&rec, tbl, tbl->keys[i], vals[tbl->keys[i]]))
+	return false;
+
+  head.len = rec.len - sizeof (head);
+  head.sum = checksum (rec.buf + sizeof (head), head.len);
+  memcpy (rec.buf, &head, sizeof (head));
+
+  tbl->dirty = true;
+  if (!hold.on)
+    return log_emit (rec.buf, rec.len, 1);
+
+  if (!rec_push (&hold.buf, rec.buf, rec.len))
+    return false;
+  hold.num++;
+  return true;
+}
+
+/* VALS is the whole row as it is about to become, the record goes out
+   ahead of the change so that nothing after it is left to fail */
+bool
+log_put (table_t *tbl, const value_t *vals)
+{
+  return log_write (tbl, OP_PUT, vals);
+}
+
+bool
+log_del (table_t *tbl, size_t row)
+{
+  value_t vals[FIELD_MAX];
+  table_get (tbl, row, vals);
+  return log_write (tbl, OP_DEL, vals);
+}
+
+/* the records written until log_release go out together, so a request
+   that changes many rows still costs a single write and sync */
+void
+log_hold (void)
+{
+  hold.on = true;
+}
+
+bool
+log_release (void)
+{
+  hold.on = false;
+  if (!hold.num)
+    return true;
+
+  bool ok = log_emit (hold.buf.buf, hold.buf.len, hold.num);
+  hold.buf.len = 0;
+  hold.num = 0;
+  return ok;
+}
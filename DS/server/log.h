@@ -0,0 +1,42 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "table.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOG_CHECKPOINT 4096
+
+typedef struct
+{
+  uint64_t batches;
+  uint64_t records;
+  uint64_t last_batch;
+  uint64_t max_batch;
+
+  uint64_t last_us;
+  uint64_t max_us;
+  uint64_t total_us;
+} log_stat_t;
+
+extern void log_init (void);
+extern void log_sync (void);
+extern bool log_reset (void);
+extern bool log_rotate (void);
+extern bool log_full (void);
+extern void log_drop (void);
+
+extern bool log_put (table_t *tbl, const value_t *vals);
+extern bool log_del (table_t *tbl, size_t row);
+extern void log_hold (void);
+extern bool log_release (void);
+
+extern bool log_group (unsigned window, void (*notify) (void *), void *arg);
+extern bool log_async (int wake_fd, const void *wake_buf, size_t wake_len);
+extern void log_coalesce (unsigned interval);
+extern long log_poll (void);
+extern uint64_t log_lsn (void);
+extern uint64_t log_synced (void);
+extern log_stat_t log_stat (void);
+
+#endif
@@ -1,41 +1,609 @@
+#define _GNU_SOURCE
+
 #include "api.h"
+#include "arena.h"
+#include "json.h"
+#include "log.h"
 #include "mongoose.h"
+#include "pool.h"
+#include "session.h"
 #include "table.h"
+#include "util.h"
+#include "view.h"
+#ifdef USE_URING
+#include "uring.h"
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECKPOINT_INTERVAL 60000
+#define COMPACT_INTERVAL 100
+#define LOG_FULL_INTERVAL 100
+#define LISTEN_URL "http://127.0.0.1:8000"
+#define REACTOR_MAX 256
+
+/* a reply held back until the log records it wrote are synced, CONTENT
+   is copied out of the request arena; or a list still going out in
+   chunks from CURSOR, OFF where api_stream is in it */
+typedef struct
+{
+  uint64_t lsn;
+  int status;
+  char *content;
+  size_t len;
+  size_t off;
+  view_cursor_t *cursor;
+} pending_t;
+
+_Static_assert (sizeof (pending_t) <= MG_DATA_SIZE, "MG_DATA_SIZE");
+
+/* one event loop with its own listener, several of them share the port
+   through SO_REUSEPORT and the kernel spreads connections across them */
+typedef struct
+{
+  struct mg_mgr mgr;
+  unsigned long wake_id;
+  pthread_t thread;
+  int cpu;
+} reactor_t;
 
-static bool stop = false;
+static volatile sig_atomic_t stop = false;
+static bool fast = false;
+static bool async = false;
+static unsigned workers = 0;
+
+static unsigned nreactor = 1;
+static reactor_t reactors[REACTOR_MAX];
+
+#ifdef USE_URING
+#define OPTIONS "g:fac:ew:r:psu"
+static bool uring = false;
+#else
+#define OPTIONS "g:fac:ew:r:ps"
+#endif
+
+static void usage (const char *prog);
+static void quit (int sig);
+static void wake (void *arg);
+static void pin (int cpu);
+static void *reactor_run (void *arg);
+static struct mg_connection *listen_shared (struct mg_mgr *mgr);
+static void reactor_init (reactor_t *r, bool wakeup);
+static void checkpoint (void *arg);
+static void checkpoint_full (void *arg);
+static void compact (void *arg);
+static void reply (struct mg_connection *conn, api_ret ret);
+static void pump (struct mg_connection *conn, bool finish);
+static void collect (struct mg_mgr *mgr);
+static void serve (long window, bool pinned);
+#ifdef USE_URING
+static void serve_uring (long window);
+#endif
 static void handle (struct mg_connection *conn, int ev, void *ev_data);
 
 int
-main ()
+main (int argc, char **argv)
 {
+  int opt;
+  long window = -1;
+  long coalesce = -1;
+  bool export = false;
+  bool pinned = false;
+
+  while ((opt = getopt (argc, argv, OPTIONS)) != -1)
+    switch (opt)
+      {
+      case 'g':
+	window = strtol (optarg, NULL, 10);
+	if (window < 0)
+	  usage (argv[0]);
+	break;
+      case 'f':
+	fast = true;
+	break;
+      case 'a':
+	async = true;
+	break;
+      case 'c':
+	coalesce = strtol (optarg, NULL, 10);
+	if (coalesce < 0)
+	  usage (argv[0]);
+	break;
+      case 'e':
+	export = true;
+	break;
+      case 'w':
+	workers = strtoul (optarg, NULL, 10);
+	break;
+      case 'r':
+	nreactor = strtoul (optarg, NULL, 10);
+	if (!nreactor || nreactor > REACTOR_MAX)
+	  usage (argv[0]);
+	break;
+      case 'p':
+	pinned = true;
+	break;
+      case 's':
+	api_stat = true;
+	break;
+#ifdef USE_URING
+      case 'u':
+	uring = true;
+	break;
+#endif
+      default:
+	usage (argv[0]);
+      }
+
+  /* replies are collected by connection id, which is per event loop */
+  if (workers && nreactor > 1)
+    usage (argv[0]);
+
+  /* the async and coalesced logs are driven by a single loop and replace
+     the log thread */
+  if (async && (window >= 0 || nreactor > 1 || coalesce >= 0))
+    usage (argv[0]);
+  if (coalesce >= 0 && (window >= 0 || nreactor > 1))
+    usage (argv[0]);
+
+#ifdef USE_URING
+  /* the io_uring loop runs every request itself on one thread */
+  if (uring && (workers || nreactor > 1 || async))
+    usage (argv[0]);
+#endif
+
+  json_init ();
+  api_init ();
+
   table_init ();
+  view_build ();
+  arena_reset ();
 
-  struct mg_mgr mgr;
-  mg_mgr_init (&mgr);
+  if (export)
+    {
+      if (!table_export ())
+	error ("数据表导出失败");
+      return EXIT_SUCCESS;
+    }
+
+  signal (SIGINT, quit);
+  signal (SIGTERM, quit);
+
+  if (coalesce >= 0)
+    log_coalesce (coalesce);
+
+#ifdef USE_URING
+  if (uring)
+    serve_uring (window);
+  else
+#endif
+    serve (window, pinned);
+
+  /* waits for requests still running on the workers */
+  table_wrlock ();
+
+  if (!table_checkpoint ())
+    error ("检查点写入失败");
+}
+
+/* the mongoose event loops, returns once they all stopped */
+static void
+serve (long window, bool pinned)
+{
+  long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+  bool wakeup = window >= 0 || workers || async;
+
+  for (unsigned i = 0; i < nreactor; i++)
+    {
+      reactors[i].cpu = pinned ? (int) (i % (ncpu > 0 ? ncpu : 1)) : -1;
+      reactor_init (reactors + i, wakeup);
+    }
+
+  struct mg_mgr *mgr = &reactors[0].mgr;
+  mg_timer_add (mgr, CHECKPOINT_INTERVAL, MG_TIMER_REPEAT, checkpoint, NULL);
+  mg_timer_add (mgr, LOG_FULL_INTERVAL, MG_TIMER_REPEAT, checkpoint_full,
+		NULL);
+  mg_timer_add (mgr, COMPACT_INTERVAL, MG_TIMER_REPEAT, compact, NULL);
+
+  if (window >= 0 && !log_group (window, wake, NULL))
+    error ("日志线程创建失败");
+
+  /* the ring itself sends what mg_wakeup would once a batch is synced */
+  if (async
+      && !log_async (mgr->pipe, &reactors[0].wake_id,
+		     sizeof (reactors[0].wake_id)))
+    error ("异步日志初始化失败");
+
+  if (workers && !pool_start (workers, wake, NULL))
+    error ("工作线程创建失败");
+
+  for (unsigned i = 1; i < nreactor; i++)
+    if (0 != pthread_create (&reactors[i].thread, NULL, reactor_run,
+			     reactors + i))
+      error ("事件循环线程创建失败");
+
+  reactor_run (reactors);
+
+  for (unsigned i = 1; i < nreactor; i++)
+    pthread_join (reactors[i].thread, NULL);
+
+  for (unsigned i = 0; i < nreactor; i++)
+    mg_mgr_free (&reactors[i].mgr);
+}
+
+#ifdef USE_URING
+static void
+serve_uring (long window)
+{
+  uring_init (LISTEN_URL);
+  uring_timer (CHECKPOINT_INTERVAL, checkpoint, NULL);
+  uring_timer (LOG_FULL_INTERVAL, checkpoint_full, NULL);
+  uring_timer (COMPACT_INTERVAL, compact, NULL);
+
+  if (window >= 0 && !log_group (window, wake, NULL))
+    error ("日志线程创建失败");
+
+  uring_run (&stop, fast);
+  uring_free ();
+}
+#endif
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr,
+	   "用法: %s [-g 提交窗口毫秒数] [-f] [-a] [-c 合并间隔毫秒数] [-e]"
+	   " [-w 线程数] [-r 事件循环数] [-p] [-s]"
+#ifdef USE_URING
+	   " [-u]"
+#endif
+	   "\n",
+	   prog);
+  fprintf (stderr, "  -g  开启组提交, 由后台线程批量写入并同步日志\n");
+  fprintf (stderr, "  -f  组提交时不等待日志同步即返回响应\n");
+  fprintf (stderr, "  -a  由事件循环经 io_uring 异步写入并同步日志\n");
+  fprintf (stderr, "  -c  由事件循环合并写入日志, 每轮或每个间隔最多一次\n");
+  fprintf (stderr, "  -e  将数据表导出为 json 文件后退出\n");
+  fprintf (stderr, "  -w  由工作线程池处理请求, 只读请求并发执行\n");
+  fprintf (stderr, "  -r  启动多个事件循环, 以 SO_REUSEPORT 共享端口\n");
+  fprintf (stderr, "  -p  将每个事件循环绑定到一个 CPU\n");
+  fprintf (stderr, "  -s  开放无需登录的 /api/sys/stat 统计接口\n");
+#ifdef USE_URING
+  fprintf (stderr, "  -u  以 io_uring 事件循环代替 mongoose\n");
+#endif
+  fprintf (stderr, "  -w 与 -r 不能同时使用\n");
+  fprintf (stderr, "  -a 与 -c 不能同时使用, 也不能与 -g 或 -r 同时使用\n");
+#ifdef USE_URING
+  fprintf (stderr, "  -u 不能与 -w, -r 或 -a 同时使用\n");
+#endif
+  exit (EXIT_FAILURE);
+}
+
+static void
+quit (int sig)
+{
+  (void) sig;
+  stop = true;
+}
+
+/* runs on the log and worker threads, mg_wakeup is the only safe way
+   back in, every loop may hold replies waiting for the log */
+static void
+wake (void *arg)
+{
+  (void) arg;
+#ifdef USE_URING
+  if (uring)
+    {
+      uring_wake ();
+      return;
+    }
+#endif
+  for (unsigned i = 0; i < nreactor; i++)
+    mg_wakeup (&reactors[i].mgr, reactors[i].wake_id, "", 0);
+}
+
+static void
+pin (int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO (&set);
+  CPU_SET (cpu, &set);
+
+  if (0 != pthread_setaffinity_np (pthread_self (), sizeof (set), &set))
+    fprintf (stderr, "绑定 CPU %d 失败\n", cpu);
+}
+
+/* mongoose has no listener option for SO_REUSEPORT, so the socket is
+   opened here and swapped into a regular http listener */
+static struct mg_connection *
+listen_shared (struct mg_mgr *mgr)
+{
+  struct mg_connection *lsn;
+  struct mg_addr addr = { .port = mg_htons (mg_url_port (LISTEN_URL)) };
+
+  if (!mg_aton (mg_url_host (LISTEN_URL), &addr))
+    return NULL;
+
+  int fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return NULL;
+
+  int on = 1;
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = addr.port };
+  memcpy (&sin.sin_addr, addr.ip, sizeof (sin.sin_addr));
+
+  if (0 != setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on))
+      || 0 != setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on))
+      || 0 != bind (fd, (struct sockaddr *) &sin, sizeof (sin))
+      || 0 != listen (fd, MG_SOCK_LISTEN_BACKLOG_SIZE))
+    goto err;
+
+  if (!(lsn = mg_http_listen (mgr, "http://127.0.0.1:0", handle, NULL)))
+    goto err;
+
+  epoll_ctl (mgr->epoll_fd, EPOLL_CTL_DEL, (int) (size_t) lsn->fd, NULL);
+  close ((int) (size_t) lsn->fd);
+
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  lsn->fd = (void *) (size_t) fd;
+  lsn->loc = addr;
+  MG_EPOLL_ADD (lsn);
+  return lsn;
 
-  mg_http_listen (&mgr, "http://127.0.0.1:8000", handle, NULL);
+err:
+  close (fd);
+  return NULL;
+}
+
+static void
+reactor_init (reactor_t *r, bool wakeup)
+{
+  struct mg_connection *lsn;
+  mg_mgr_init (&r->mgr);
 
+  if (nreactor > 1)
+    lsn = listen_shared (&r->mgr);
+  else
+    lsn = mg_http_listen (&r->mgr, LISTEN_URL, handle, NULL);
+
+  if (!lsn)
+    error ("监听 %s 失败", LISTEN_URL);
+
+  if (wakeup && !mg_wakeup_init (&r->mgr))
+    error ("事件循环唤醒初始化失败");
+
+  r->wake_id = lsn->id;
+}
+
+static void *
+reactor_run (void *arg)
+{
+  reactor_t *r = arg;
+  if (r->cpu >= 0)
+    pin (r->cpu);
+
+  long wait = -1;
   while (!stop)
-    mg_mgr_poll (&mgr, 1000);
+    {
+      mg_mgr_poll (&r->mgr, wait >= 0 && wait < 1000 ? wait : 1000);
+      if (workers)
+	collect (&r->mgr);
+      wait = log_poll ();
+    }
+
+  arena_release ();
+  return NULL;
+}
 
-  mg_mgr_free (&mgr);
+/* writers are held off only for the fork, the child does the saving */
+static void
+checkpoint (void *arg)
+{
+  (void) arg;
+  table_rdlock ();
+  if (!table_bgsave ())
+    fprintf (stderr, "后台快照启动失败\n");
+  table_unlock ();
+}
+
+/* the same once the log grew long, the request that made it so has
+   long replied */
+static void
+checkpoint_full (void *arg)
+{
+  (void) arg;
+  table_rdlock ();
+  if (log_full () && !table_bgsave ())
+    fprintf (stderr, "后台快照启动失败\n");
+  table_unlock ();
+}
+
+/* timers fire between requests, so no slot is held across a slice; the
+   writers are held off for one slice at a time, not a whole table */
+static void
+compact (void *arg)
+{
+  (void) arg;
+  table_wrlock ();
+  table_compact (view_move);
+  table_unlock ();
+}
+
+/* straight into the send buffer, sized up front */
+static void
+reply (struct mg_connection *conn, api_ret ret)
+{
+  if (api_streamed (&ret))
+    {
+      *(pending_t *) conn->data = (pending_t){ .cursor = ret.cursor };
+      pump (conn, false);
+      return;
+    }
+
+  struct mg_iobuf *io = &conn->send;
+  size_t size = api_reply_size (&ret);
+
+  if (io->len + size > io->size && !mg_iobuf_resize (io, io->len + size))
+    {
+      conn->is_closing = 1;
+      return;
+    }
+
+  api_reply ((char *) io->buf + io->len, &ret);
+  io->len += size;
+  conn->is_resp = 0;
+}
+
+/* tops the send buffer up with the next chunks of a streamed reply, the
+   connection takes its next request once FINISH sees it all queued, on
+   a poll so that mongoose notices */
+static void
+pump (struct mg_connection *conn, bool finish)
+{
+  pending_t *pend = (pending_t *) conn->data;
+  struct mg_iobuf *io = &conn->send;
+
+  while (!api_stream_done (pend->off) && io->len < API_CHUNK)
+    {
+      if (io->len + API_STREAM_STEP > io->size
+	  && !mg_iobuf_resize (io, io->len + API_STREAM_STEP))
+	{
+	  conn->is_closing = 1;
+	  return;
+	}
+
+      char *end = api_stream ((char *) io->buf + io->len, pend->cursor,
+			      &pend->off);
+      if (!end)
+	{
+	  conn->is_closing = 1;
+	  return;
+	}
+      io->len = end - (char *) io->buf;
+    }
+
+  if (finish && api_stream_done (pend->off))
+    {
+      view_close (pend->cursor);
+      pend->cursor = NULL;
+      conn->is_resp = 0;
+    }
+}
+
+/* replies of connections closed meanwhile are dropped */
+static void
+collect (struct mg_mgr *mgr)
+{
+  for (pool_ret *ret = pool_take (), *next; ret; ret = next)
+    {
+      next = ret->next;
+
+      struct mg_connection *conn = mgr->conns;
+      while (conn && conn->id != ret->id)
+	conn = conn->next;
+
+      pending_t *pend = conn ? (pending_t *) conn->data : NULL;
+
+      if (!conn)
+	pool_content_free (ret);
+      else if (fast || !ret->lsn || log_synced () >= ret->lsn)
+	{
+	  reply (conn, (api_ret){ .status = ret->status,
+				  .content = ret->content,
+				  .len = ret->len,
+				  .shared = ret->shared,
+				  .cursor = ret->cursor });
+	  ret->cursor = NULL;
+	  pool_content_free (ret);
+	}
+      else
+	*pend = (pending_t){ .lsn = ret->lsn,
+			     .status = ret->status,
+			     .content = ret->content,
+			     .len = ret->len };
+
+      free (ret);
+    }
 }
 
 static void
 handle (struct mg_connection *conn, int ev, void *ev_data)
 {
+  pending_t *pend = (pending_t *) conn->data;
+
+  if (ev == MG_EV_WRITE && pend->cursor)
+    {
+      pump (conn, false);
+      return;
+    }
+
+  if (ev == MG_EV_POLL)
+    {
+      if (pend->cursor)
+	pump (conn, true);
+      else if (pend->lsn && log_synced () >= pend->lsn)
+	{
+	  reply (conn, (api_ret){ .status = pend->status,
+				  .content = pend->content,
+				  .len = pend->len });
+	  free (pend->content);
+	  pend->lsn = 0;
+	}
+      return;
+    }
+
+  if (ev == MG_EV_CLOSE)
+    {
+      if (pend->lsn)
+	free (pend->content);
+      else if (pend->cursor)
+	view_close (pend->cursor);
+      return;
+    }
+
   if (ev != MG_EV_HTTP_MSG)
     return;
 
   struct mg_http_message *msg = ev_data;
+
+  if (workers)
+    {
+      if (!pool_submit (conn->id, msg))
+	mg_http_reply (conn, 503, "", "");
+      return;
+    }
+
+  /* other event loops may be running requests at the same time */
+  bool readonly = api_readonly (msg);
+  readonly ? table_rdlock () : table_wrlock ();
+
+  uint64_t lsn = log_lsn ();
   api_ret ret = api_handle (msg);
+  uint64_t end = log_lsn ();
+
+  table_unlock ();
 
-  mg_http_reply (conn, 200, "Content-Type: application/json\r\n",
-		 "{\"code\": %d, \"data\": %s}", ret.status, ret.content);
+  if (fast || end == lsn || log_synced () >= end)
+    reply (conn, ret);
+  else
+    {
+      char *content;
+      if (!(content = strdup (ret.content)))
+	error ("内存不足");
+      *pend = (pending_t){ .lsn = end,
+			   .status = ret.status,
+			   .content = content,
+			   .len = ret.len };
+    }
 
-  if (ret.need_free)
-    free ((char *) ret.content);
+  /* nothing built for this request outlives it */
+  arena_reset ();
 }
@@ -0,0 +1,181 @@
+#include "pool.h"
+#include "api.h"
+#include "arena.h"
+#include "cache.h"
+#include "log.h"
+#include "mongoose.h"
+#include "table.h"
+#include "util.h"
+#include "view.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the raw request is copied, mongoose reuses its buffer once the
+   handler returns */
+typedef struct job_t
+{
+  struct job_t *next;
+  unsigned long id;
+  size_t len;
+  char buf[];
+} job_t;
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  job_t *head;
+  job_t **tail;
+
+  pool_ret *done;
+  pool_ret **done_tail;
+
+  void (*notify) (void *);
+  void *arg;
+} pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .tail = &pool.head,
+  .done_tail = &pool.done,
+};
+
+static inline pool_ret *
+pool_run (job_t *job)
+{
+  pool_ret *ret;
+  struct mg_http_message msg;
+
+  if (!(ret = malloc (sizeof (pool_ret))))
+    error ("内存不足");
+
+  if (mg_http_parse (job->buf, job->len, &msg) <= 0)
+    error ("请求解析失败");
+
+  bool readonly = api_readonly (&msg);
+  readonly ? table_rdlock () : table_wrlock ();
+
+  /* writers are alone under the lock, so the lsn delta is theirs */
+  uint64_t lsn = log_lsn ();
+  api_ret aret = api_handle (&msg);
+  ret->lsn = log_lsn () != lsn ? log_lsn () : 0;
+
+  table_unlock ();
+
+  ret->next = NULL;
+  ret->id = job->id;
+  ret->status = aret.status;
+  ret->len = aret.len;
+  ret->cursor = aret.cursor;
+
+  /* only replies that wait for nothing are sent straight from the cache */
+  ret->shared = aret.shared && !ret->lsn;
+  if (ret->shared)
+    {
+      cache_pin (aret.content);
+      ret->content = (char *) aret.content;
+    }
+  else if (ret->cursor)
+    ret->content = NULL;
+  else if (!(ret->content = strdup (aret.content)))
+    error ("内存不足");
+
+  arena_reset ();
+  return ret;
+}
+
+static void *
+pool_work (void *arg)
+{
+  (void) arg;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&pool.lock);
+      while (!pool.head)
+	pthread_cond_wait (&pool.cond, &pool.lock);
+
+      job_t *job = pool.head;
+      if (!(pool.head = job->next))
+	pool.tail = &pool.head;
+      pthread_mutex_unlock (&pool.lock);
+
+      pool_ret *ret = pool_run (job);
+      free (job);
+
+      pthread_mutex_lock (&pool.lock);
+      *pool.done_tail = ret;
+      pool.done_tail = &ret->next;
+      pthread_mutex_unlock (&pool.lock);
+
+      pool.notify (pool.arg);
+    }
+
+  return NULL;
+}
+
+/* NOTIFY runs on a worker after each request, it has to wake the event
+   loop so it can collect the reply with pool_take */
+bool
+pool_start (unsigned num, void (*notify) (void *), void *arg)
+{
+  pool.notify = notify;
+  pool.arg = arg;
+
+  for (unsigned i = 0; i < num; i++)
+    {
+      pthread_t thread;
+      if (0 != pthread_create (&thread, NULL, pool_work, NULL))
+	return false;
+      pthread_detach (thread);
+    }
+
+  return true;
+}
+
+bool
+pool_submit (unsigned long id, struct mg_http_message *msg)
+{
+  job_t *job;
+  size_t len = msg->message.len;
+
+  if (!(job = malloc (sizeof (job_t) + len)))
+    return false;
+
+  job->next = NULL;
+  job->id = id;
+  job->len = len;
+  memcpy (job->buf, msg->message.buf, len);
+
+  pthread_mutex_lock (&pool.lock);
+  *pool.tail = job;
+  pool.tail = &job->next;
+  pthread_cond_signal (&pool.cond);
+  pthread_mutex_unlock (&pool.lock);
+  return true;
+}
+
+/* every reply finished so far, oldest first */
+pool_ret *
+pool_take (void)
+{
+  pthread_mutex_lock (&pool.lock);
+  pool_ret *done = pool.done;
+  pool.done = NULL;
+  pool.done_tail = &pool.done;
+  pthread_mutex_unlock (&pool.lock);
+  return done;
+}
+
+/* gives CONTENT or CURSOR back, not RET itself */
+void
+pool_content_free (pool_ret *ret)
+{
+  if (ret->cursor)
+    view_close (ret->cursor);
+  else if (ret->shared)
+    cache_unpin (ret->content);
+  else
+    free (ret->content);
+}
@@ -0,0 +1,30 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a finished request, CONTENT is owned by the taker, heap memory or with
+   SHARED a pinned cache buffer, or CURSOR a list to stream; LSN the log
+   record the reply has to wait for, 0 if none */
+typedef struct pool_ret
+{
+  struct pool_ret *next;
+  unsigned long id;
+  int status;
+  char *content;
+  size_t len;
+  bool shared;
+  struct view_cursor *cursor;
+  uint64_t lsn;
+} pool_ret;
+
+struct mg_http_message;
+
+extern bool pool_start (unsigned num, void (*notify) (void *), void *arg);
+extern bool pool_submit (unsigned long id, struct mg_http_message *msg);
+extern pool_ret *pool_take (void);
+extern void pool_content_free (pool_ret *ret);
+
+#endif
@@ -0,0 +1,142 @@
+#include "ring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool
+ring_init (ring_t *ring, unsigned entries)
+{
+  struct io_uring_params p = { 0 };
+  *ring = (ring_t){ .fd = -1 };
+
+  if ((ring->fd = syscall (__NR_io_uring_setup, entries, &p)) < 0)
+    return false;
+
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_size > ring->sq_size)
+    ring->sq_size = ring->cq_size;
+
+  ring->sq_map = mmap (NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED)
+    goto err;
+
+  ring->cq_map = ring->sq_map;
+  if (!single)
+    ring->cq_map = mmap (NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+  if (ring->cq_map == MAP_FAILED)
+    goto err2;
+
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto err3;
+
+  char *sq = ring->sq_map, *cq = ring->cq_map;
+
+  ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->tail = ring->submitted = *ring->sq_tail;
+
+  unsigned *array = (unsigned *) (sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    array[i] = i;
+
+  ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return true;
+
+err3:
+  if (!single)
+    munmap (ring->cq_map, ring->cq_size);
+err2:
+  munmap (ring->sq_map, ring->sq_size);
+err:
+  close (ring->fd);
+  ring->fd = -1;
+  return false;
+}
+
+void
+ring_free (ring_t *ring)
+{
+  if (ring->fd < 0)
+    return;
+
+  munmap (ring->sqes, ring->sqes_size);
+  if (ring->cq_map != ring->sq_map)
+    munmap (ring->cq_map, ring->cq_size);
+  munmap (ring->sq_map, ring->sq_size);
+
+  close (ring->fd);
+  ring->fd = -1;
+}
+
+/* a full ring is flushed right away; NULL with errno EBUSY when the
+   kernel takes none of it, as while completions overflow the completion
+   queue, the caller has to reap some before it asks again */
+struct io_uring_sqe *
+ring_sqe (ring_t *ring, uint64_t data)
+{
+  unsigned head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->tail - head >= ring->sq_entries)
+    {
+      if (!ring_submit (ring, 0))
+	return NULL;
+
+      head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+      if (ring->tail - head >= ring->sq_entries)
+	{
+	  errno = EBUSY;
+	  return NULL;
+	}
+    }
+
+  struct io_uring_sqe *sqe = ring->sqes + (ring->tail++ & ring->sq_mask);
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->user_data = data;
+  return sqe;
+}
+
+/* hands every queued sqe to the kernel and waits for WAIT completions,
+   a signal only cuts the wait short */
+bool
+ring_submit (ring_t *ring, unsigned wait)
+{
+  __atomic_store_n (ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  int ret = syscall (__NR_io_uring_enter, ring->fd,
+		     ring->tail - ring->submitted, wait, flags, NULL, 0);
+
+  if (ret >= 0)
+    ring->submitted += ret;
+  return ret >= 0 || errno == EINTR || errno == EBUSY || errno == EAGAIN;
+}
+
+struct io_uring_cqe *
+ring_peek (ring_t *ring)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return ring->cqes + (head & ring->cq_mask);
+}
+
+void
+ring_next (ring_t *ring)
+{
+  __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,44 @@
+#ifndef RING_H
+#define RING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a bare io_uring driven through the raw syscalls, sqes are used in ring
+   order and queue up until ring_submit */
+typedef struct
+{
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned tail;
+  unsigned submitted;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map;
+  size_t sq_size;
+  void *cq_map;
+  size_t cq_size;
+  size_t sqes_size;
+} ring_t;
+
+extern bool ring_init (ring_t *ring, unsigned entries);
+extern void ring_free (ring_t *ring);
+
+extern struct io_uring_sqe *ring_sqe (ring_t *ring, uint64_t data);
+extern bool ring_submit (ring_t *ring, unsigned wait);
+
+extern struct io_uring_cqe *ring_peek (ring_t *ring);
+extern void ring_next (ring_t *ring);
+
+#endif
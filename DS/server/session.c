@@ -0,0 +1,270 @@
+#include "session.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#define SESSION_KEY 16
+#define SESSION_MAX 65536
+#define SESSION_BUCKETS 65536
+#define SESSION_ACCOUNT_MAX 8
+
+/* every session sits in the chain of its bucket, in the chain of its
+   account's bucket and in the age list, which a lookup moves it to the
+   end of, so the oldest is always first */
+typedef struct session_t
+{
+  struct session_t *next;
+  struct session_t *peer;
+  struct session_t *older;
+  struct session_t *newer;
+  unsigned char key[SESSION_KEY];
+  table_t *tbl;
+  uint64_t id;
+  uint64_t expire;
+} session_t;
+
+/* logins add sessions side by side under the table read lock, so it has
+   a lock of its own */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the keys are random, their first bytes hash well enough */
+static session_t *buckets[SESSION_BUCKETS];
+static session_t *accounts[SESSION_BUCKETS];
+static session_t ages = { .older = &ages, .newer = &ages };
+static size_t live;
+
+static inline uint64_t
+now_sec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static inline session_t **
+slot (const unsigned char *key)
+{
+  uint64_t hash;
+  memcpy (&hash, key, sizeof (hash));
+
+  session_t **link = buckets + (hash & (SESSION_BUCKETS - 1));
+  while (*link && memcmp ((*link)->key, key, SESSION_KEY) != 0)
+    link = &(*link)->next;
+  return link;
+}
+
+static inline session_t **
+account (table_t *tbl, uint64_t id)
+{
+  uint64_t hash = (id * TABLE_NUM + (tbl - tables)) * 0x9e3779b97f4a7c15ULL;
+  return accounts + (hash >> 32 & (SESSION_BUCKETS - 1));
+}
+
+static inline void
+age_unlink (session_t *sess)
+{
+  sess->older->newer = sess->newer;
+  sess->newer->older = sess->older;
+}
+
+static inline void
+age_append (session_t *sess)
+{
+  sess->older = ages.older;
+  sess->newer = &ages;
+  ages.older->newer = sess;
+  ages.older = sess;
+}
+
+/* called with LOCK held */
+static inline void
+drop (session_t *sess)
+{
+  *slot (sess->key) = sess->next;
+
+  session_t **link = account (sess->tbl, sess->id);
+  while (*link != sess)
+    link = &(*link)->peer;
+  *link = sess->peer;
+
+  age_unlink (sess);
+  free (sess);
+  live--;
+}
+
+/* called with LOCK held, only ever looks at the oldest sessions */
+static inline void
+reap (uint64_t now)
+{
+  while (ages.newer != &ages && ages.newer->expire <= now)
+    drop (ages.newer);
+}
+
+static inline bool
+key_parse (const char *token, unsigned char *key)
+{
+  for (size_t i = 0; i < SESSION_TOKEN_LEN; i++)
+    {
+      char c = token[i];
+      int val;
+
+      if (c >= '0' && c <= '9')
+	val = c - '0';
+      else if (c >= 'a' && c <= 'f')
+	val = c - 'a' + 10;
+      else
+	return false;
+
+      key[i / 2] = i % 2 ? key[i / 2] | val : val << 4;
+    }
+
+  return token[SESSION_TOKEN_LEN] == '\0';
+}
+
+static inline void
+key_format (const unsigned char *key, char *token)
+{
+  static const char digits[] = "0123456789abcdef";
+
+  for (size_t i = 0; i < SESSION_KEY; i++)
+    {
+      token[i * 2] = digits[key[i] >> 4];
+      token[i * 2 + 1] = digits[key[i] & 15];
+    }
+  token[SESSION_TOKEN_LEN] = '\0';
+}
+
+/* called with LOCK held, an account at SESSION_ACCOUNT_MAX loses its
+   least recently used session, the chain runs from the newest login so
+   a tie goes to the older one; one account cannot crowd out the rest */
+static inline void
+trim (table_t *tbl, uint64_t id)
+{
+  session_t *oldest = NULL;
+  size_t num = 0;
+
+  for (session_t *sess = *account (tbl, id); sess; sess = sess->peer)
+    if (sess->tbl == tbl && sess->id == id)
+      {
+	num++;
+	if (!oldest || sess->expire <= oldest->expire)
+	  oldest = sess;
+      }
+
+  if (num >= SESSION_ACCOUNT_MAX)
+    drop (oldest);
+}
+
+/* SESSION_FULL while SESSION_MAX sessions are in use, sessions of other
+   accounts are never ended to make room */
+int
+session_new (table_t *tbl, size_t row, char token[SESSION_TOKEN_LEN + 1])
+{
+  session_t *sess;
+  if (!(sess = malloc (sizeof (session_t))))
+    return SESSION_FAIL;
+
+  if (getrandom (sess->key, SESSION_KEY, 0) != SESSION_KEY)
+    {
+      free (sess);
+      return SESSION_FAIL;
+    }
+
+  sess->tbl = tbl;
+  sess->id = ROW_ID (tbl, row);
+
+  uint64_t now = now_sec ();
+  sess->expire = now + SESSION_TTL;
+
+  pthread_mutex_lock (&lock);
+
+  reap (now);
+  trim (tbl, sess->id);
+
+  if (live == SESSION_MAX)
+    {
+      pthread_mutex_unlock (&lock);
+      free (sess);
+      return SESSION_FULL;
+    }
+
+  session_t **link = slot (sess->key);
+  if (*link)
+    {
+      /* 128 random bits never collide, but a clash must not hand out
+	 someone else's session */
+      pthread_mutex_unlock (&lock);
+      free (sess);
+      return SESSION_FAIL;
+    }
+
+  sess->next = NULL;
+  *link = sess;
+
+  session_t **peers = account (tbl, sess->id);
+  sess->peer = *peers;
+  *peers = sess;
+
+  age_append (sess);
+  live++;
+
+  pthread_mutex_unlock (&lock);
+
+  key_format (sess->key, token);
+  return SESSION_OK;
+}
+
+/* TOKEN is good and belongs to an account of TBL, which gives it another
+   SESSION_TTL; the account is found again by its row id, wherever a
+   compaction moved it */
+bool
+session_find (const char *token, table_t *tbl, size_t *row)
+{
+  unsigned char key[SESSION_KEY];
+  if (!key_parse (token, key))
+    return false;
+
+  uint64_t now = now_sec ();
+  pthread_mutex_lock (&lock);
+
+  reap (now);
+  session_t *sess = *slot (key);
+  bool found = sess && sess->tbl == tbl;
+  uint64_t id = 0;
+
+  if (found)
+    {
+      sess->expire = now + SESSION_TTL;
+      age_unlink (sess);
+      age_append (sess);
+      id = sess->id;
+    }
+
+  pthread_mutex_unlock (&lock);
+  return found && find_id (tbl, id, row);
+}
+
+/* the account at ROW went away or changed its password, every session of
+   it ends but KEEP, if given */
+void
+session_drop (table_t *tbl, size_t row, const char *keep)
+{
+  unsigned char key[SESSION_KEY];
+  bool kept = keep && key_parse (keep, key);
+  uint64_t id = ROW_ID (tbl, row);
+
+  pthread_mutex_lock (&lock);
+
+  for (session_t *sess = *account (tbl, id), *peer; sess; sess = peer)
+    {
+      peer = sess->peer;
+      if (sess->tbl == tbl && sess->id == id
+	  && !(kept && memcmp (sess->key, key, SESSION_KEY) == 0))
+	drop (sess);
+    }
+
+  pthread_mutex_unlock (&lock);
+}
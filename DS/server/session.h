@@ -0,0 +1,29 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "table.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* hex digits of a token, which is 16 random bytes */
+#define SESSION_TOKEN_LEN 32
+
+/* seconds a session lives past its last use */
+#define SESSION_TTL 1800
+
+enum
+{
+  SESSION_OK,
+  SESSION_FULL,
+  SESSION_FAIL,
+};
+
+/* a logged in account, ROW of the student or merchant table; the session
+   holds on to its row id, so the row it hands back is the account's slot
+   at the time of the lookup, good until the request ends */
+extern int session_new (table_t *tbl, size_t row,
+			char token[SESSION_TOKEN_LEN + 1]);
+extern bool session_find (const char *token, table_t *tbl, size_t *row);
+extern void session_drop (table_t *tbl, size_t row, const char *keep);
+
+#endif
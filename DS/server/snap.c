@@ -0,0 +1,212 @@
+#include "snap.h"
+#include "util.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* layout: head, then one column of ROWS fixed 8-byte cells per field, then
+   a heap of NUL-terminated strings the string cells point into */
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t fields;
+  uint32_t rsize;
+  uint64_t rows;
+  uint64_t heap;
+} snap_head_t;
+
+typedef union
+{
+  int64_t ival;
+  double nval;
+  struct
+  {
+    uint32_t off;
+    uint32_t len;
+  } sval;
+} snap_cell_t;
+
+_Static_assert (sizeof (snap_head_t) == 32, "snap_head_t");
+_Static_assert (sizeof (snap_cell_t) == 8, "snap_cell_t");
+_Static_assert (sizeof (json_int_t) == 8, "json_int_t");
+
+/* the mapping is never released, interned strings point into its heap */
+bool
+snap_load (table_t *tbl)
+{
+  int fd = open (tbl->snap, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || (size_t) st.st_size < sizeof (snap_head_t))
+    error ("快照 %s 损坏", tbl->snap);
+
+  size_t size = st.st_size;
+  const char *map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    error ("快照 %s 映射失败", tbl->snap);
+
+  close (fd);
+  madvise ((void *) map, size, MADV_SEQUENTIAL);
+
+  size_t num = tbl->nfield;
+  const snap_head_t *head = (const snap_head_t *) map;
+  if (memcmp (head->magic, SNAP_MAGIC, 4) != 0
+      || head->version != SNAP_VERSION || head->fields != num
+      || head->rsize != num * sizeof (snap_cell_t))
+    error ("快照 %s 格式不符", tbl->snap);
+
+  size_t body = size - sizeof (snap_head_t);
+  if (head->rows > body / head->rsize
+      || head->heap != body - head->rows * head->rsize)
+    error ("快照 %s 长度不符", tbl->snap);
+
+  size_t rows = head->rows;
+  const snap_cell_t *cells = (const snap_cell_t *) (head + 1);
+  const char *heap = (const char *) (cells + rows * num);
+
+  if (!table_reserve (tbl, rows))
+    error ("内存不足");
+
+  for (size_t i = 0; i < num; i++, cells += rows)
+    {
+      if (tbl->fields[i].typ != TYP_STR)
+	{
+	  memcpy (tbl->cols[i].ints, cells, rows * sizeof (snap_cell_t));
+	  continue;
+	}
+
+      for (size_t j = 0; j < rows; j++)
+	{
+	  size_t off = cells[j].sval.off, len = cells[j].sval.len;
+	  if (off + len >= head->heap || heap[off + len] != '\0')
+	    error ("快照字符串越界");
+	  COL_SYM (tbl, i, j) = sym_intern_static (heap + off, len);
+	}
+    }
+
+  memset (tbl->dead, 0, rows * sizeof (bool));
+  for (size_t i = 0; i < rows; i++)
+    tbl->ids[i] = ++tbl->last_id;
+  tbl->num = rows;
+
+  int key = tbl->keys[0];
+  if (tbl->fields[key].typ == TYP_INT)
+    for (size_t i = 0; i < rows; i++)
+      if (COL_INT (tbl, key, i) >= tbl->serial)
+	tbl->serial = COL_INT (tbl, key, i) + 1;
+
+  return true;
+}
+
+static inline bool
+write_cells (FILE *file, table_t *tbl, uint64_t *heap)
+{
+  for (size_t i = 0; i < tbl->nfield; i++)
+    {
+      /* without tombstones a column is already in its on-disk form */
+      if (tbl->fields[i].typ != TYP_STR && !tbl->nfree)
+	{
+	  if (tbl->num
+	      && fwrite (tbl->cols[i].ints, sizeof (snap_cell_t), tbl->num,
+			 file) != tbl->num)
+	    return false;
+	  continue;
+	}
+
+      for (size_t j = 0; j < tbl->num; j++)
+	{
+	  if (!ROW_LIVE (tbl, j))
+	    continue;
+
+	  if (tbl->fields[i].typ != TYP_STR)
+	    {
+	      if (fwrite (&COL_INT (tbl, i, j), sizeof (snap_cell_t), 1, file)
+		  != 1)
+		return false;
+	      continue;
+	    }
+
+	  size_t len = sym_len (COL_SYM (tbl, i, j));
+	  if (*heap + len + 1 > UINT32_MAX)
+	    return false;
+
+	  snap_cell_t cell = { .sval = { .off = *heap, .len = len } };
+	  *heap += len + 1;
+
+	  if (fwrite (&cell, sizeof (cell), 1, file) != 1)
+	    return false;
+	}
+    }
+
+  return true;
+}
+
+static inline bool
+write_heap (FILE *file, table_t *tbl)
+{
+  for (size_t i = 0; i < tbl->nfield; i++)
+    {
+      if (tbl->fields[i].typ != TYP_STR)
+	continue;
+
+      for (size_t j = 0; j < tbl->num; j++)
+	{
+	  if (!ROW_LIVE (tbl, j))
+	    continue;
+
+	  sym_t sym = COL_SYM (tbl, i, j);
+	  if (fwrite (sym_str (sym), sym_len (sym) + 1, 1, file) != 1)
+	    return false;
+	}
+    }
+
+  return true;
+}
+
+bool
+snap_save (table_t *tbl)
+{
+  char tmp[PATH_MAX];
+  if (snprintf (tmp, sizeof (tmp), "%s.tmp", tbl->snap) >= (int) sizeof (tmp))
+    return false;
+
+  FILE *file = fopen (tmp, "w+");
+  if (!file)
+    return false;
+
+  snap_head_t head = {
+    .version = SNAP_VERSION,
+    .fields = tbl->nfield,
+    .rsize = tbl->nfield * sizeof (snap_cell_t),
+    .rows = tbl->num - tbl->nfree,
+  };
+  memcpy (head.magic, SNAP_MAGIC, sizeof (head.magic));
+
+  if (fwrite (&head, sizeof (head), 1, file) != 1
+      || !write_cells (file, tbl, &head.heap) || !write_heap (file, tbl))
+    goto err;
+
+  if (fseek (file, 0, SEEK_SET) != 0
+      || fwrite (&head, sizeof (head), 1, file) != 1)
+    goto err;
+
+  if (fflush (file) != 0 || fsync (fileno (file)) != 0)
+    goto err;
+
+  if (fclose (file) != 0 || rename (tmp, tbl->snap) != 0)
+    return false;
+
+  return true;
+
+err:
+  fclose (file);
+  return false;
+}
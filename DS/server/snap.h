@@ -0,0 +1,13 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include "table.h"
+#include <stdbool.h>
+
+#define SNAP_MAGIC "DSTB"
+#define SNAP_VERSION 2
+
+extern bool snap_load (table_t *tbl);
+extern bool snap_save (table_t *tbl);
+
+#endif
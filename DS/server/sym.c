@@ -0,0 +1,213 @@
+#include "sym.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYM_INIT_CAP 1024
+
+typedef struct
+{
+  const char *str;
+  size_t hash;
+  uint32_t len;
+  uint32_t ref;
+  sym_t next;
+  bool own;
+} sym_entry;
+
+static sym_entry *syms;
+static size_t sym_num;
+static size_t sym_cap;
+static sym_t sym_free;
+
+static sym_t *buckets;
+static size_t bucket_cap;
+static size_t live_num;
+
+/* interning may run on several threads while tables load, lookups only
+   happen once the writers are done */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t
+hash_str (const char *str, size_t len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) str[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static inline void
+sym_rehash (size_t cap)
+{
+  sym_t *temp;
+  if (!(temp = calloc (cap, sizeof (sym_t))))
+    error ("内存不足");
+
+  for (size_t i = 0; i < bucket_cap; i++)
+    for (sym_t sym = buckets[i], next; sym; sym = next)
+      {
+	next = syms[sym].next;
+	size_t slot = syms[sym].hash & (cap - 1);
+	syms[sym].next = temp[slot];
+	temp[slot] = sym;
+      }
+
+  free (buckets);
+  buckets = temp;
+  bucket_cap = cap;
+}
+
+static inline sym_t
+sym_lookup (const char *str, size_t len, size_t hash)
+{
+  if (!bucket_cap)
+    return 0;
+
+  for (sym_t sym = buckets[hash & (bucket_cap - 1)]; sym;
+       sym = syms[sym].next)
+    {
+      sym_entry *ent = syms + sym;
+      if (ent->hash == hash && ent->len == len
+	  && 0 == memcmp (ent->str, str, len))
+	return sym;
+    }
+
+  return 0;
+}
+
+static inline sym_t
+sym_new (const char *str, size_t len, size_t hash, bool own)
+{
+  if (len > UINT32_MAX)
+    error ("字符串过长");
+
+  if (live_num >= bucket_cap)
+    sym_rehash (bucket_cap ? bucket_cap * 2 : SYM_INIT_CAP);
+
+  sym_t sym = sym_free;
+  if (sym)
+    sym_free = syms[sym].next;
+  else
+    {
+      /* slot 0 stays unused so that 0 can mean "no string" */
+      if (sym_num + 1 >= sym_cap)
+	{
+	  size_t cap = sym_cap ? sym_cap * 2 : SYM_INIT_CAP;
+	  sym_entry *temp = realloc (syms, cap * sizeof (sym_entry));
+	  if (!temp)
+	    error ("内存不足");
+	  syms = temp;
+	  sym_cap = cap;
+	}
+      sym = ++sym_num;
+    }
+
+  if (own)
+    {
+      char *copy;
+      if (!(copy = malloc (len + 1)))
+	error ("内存不足");
+      memcpy (copy, str, len);
+      copy[len] = '\0';
+      str = copy;
+    }
+
+  size_t slot = hash & (bucket_cap - 1);
+  syms[sym] = (sym_entry){ .str = str,
+			   .hash = hash,
+			   .len = len,
+			   .ref = 1,
+			   .next = buckets[slot],
+			   .own = own };
+  buckets[slot] = sym;
+  live_num++;
+  return sym;
+}
+
+sym_t
+sym_find (const char *str)
+{
+  size_t len = strlen (str);
+  return sym_lookup (str, len, hash_str (str, len));
+}
+
+static inline sym_t
+sym_get (const char *str, size_t len, bool own)
+{
+  size_t hash = hash_str (str, len);
+
+  pthread_mutex_lock (&lock);
+
+  sym_t sym = sym_lookup (str, len, hash);
+  if (sym)
+    syms[sym].ref++;
+  else
+    sym = sym_new (str, len, hash, own);
+
+  pthread_mutex_unlock (&lock);
+  return sym;
+}
+
+sym_t
+sym_intern (const char *str)
+{
+  return sym_get (str, strlen (str), true);
+}
+
+/* STR must be NUL-terminated and outlive the symbol, e.g. a mapped
+   snapshot heap, it is referenced in place instead of copied */
+sym_t
+sym_intern_static (const char *str, size_t len)
+{
+  return sym_get (str, len, false);
+}
+
+void
+sym_ref (sym_t sym)
+{
+  pthread_mutex_lock (&lock);
+  syms[sym].ref++;
+  pthread_mutex_unlock (&lock);
+}
+
+void
+sym_unref (sym_t sym)
+{
+  pthread_mutex_lock (&lock);
+
+  sym_entry *ent = syms + sym;
+  if (--ent->ref)
+    {
+      pthread_mutex_unlock (&lock);
+      return;
+    }
+
+  sym_t *link = buckets + (ent->hash & (bucket_cap - 1));
+  while (*link != sym)
+    link = &syms[*link].next;
+  *link = ent->next;
+
+  if (ent->own)
+    free ((char *) ent->str);
+
+  ent->str = NULL;
+  ent->next = sym_free;
+  sym_free = sym;
+  live_num--;
+
+  pthread_mutex_unlock (&lock);
+}
+
+const char *
+sym_str (sym_t sym)
+{
+  return syms[sym].str;
+}
+
+size_t
+sym_len (sym_t sym)
+{
+  return syms[sym].len;
+}
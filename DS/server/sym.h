@@ -0,0 +1,21 @@
+#ifndef SYM_H
+#define SYM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* interned string, equal strings share one id, 0 is never a valid id */
+typedef uint32_t sym_t;
+
+extern sym_t sym_find (const char *str);
+extern sym_t sym_intern (const char *str);
+extern sym_t sym_intern_static (const char *str, size_t len);
+
+extern void sym_ref (sym_t sym);
+extern void sym_unref (sym_t sym);
+
+extern const char *sym_str (sym_t sym);
+extern size_t sym_len (sym_t sym);
+
+#endif
@@ -1,11 +1,124 @@
 #include "table.h"
+#include "arena.h"
+#include "log.h"
+#include "snap.h"
 #include "util.h"
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
-json_t *table_menu;
-json_t *table_student;
-json_t *table_merchant;
-json_t *table_evaluation;
+#define INDEX_MAX 16
+#define INDEX_INIT_CAP 64
+#define TABLE_INIT_CAP 64
+#define COMPACT_MIN 64
+#define COMPACT_SLICE 16384
+#define LOAD_REPORT 100000
+
+/* a search key as stored, strings already resolved to their symbol */
+typedef union
+{
+  json_int_t ival;
+  double nval;
+  sym_t sym;
+} cell_t;
+
+typedef struct index_node
+{
+  size_t pos;
+  size_t hash;
+  struct index_node *next;
+} index_node;
+
+typedef struct
+{
+  size_t num;
+  table_t *tbl;
+  int cols[TABLE_KEYS];
+
+  size_t cap;
+  size_t size;
+  index_node **buckets;
+} index_t;
+
+static size_t index_num;
+static index_t indexes[INDEX_MAX];
+
+/* one lock over every table, their indexes and the symbol lookups */
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* the background snapshot child and which tables it is saving */
+static struct
+{
+  pid_t pid;
+  bool dirty[TABLE_NUM];
+} bgsave;
+
+static const field_t fields_menu[] = {
+  [MENU_ID] = { TYP_INT, "id" },
+  [MENU_NAME] = { TYP_STR, "name" },
+  [MENU_USER] = { TYP_STR, "user" },
+  [MENU_PRICE] = { TYP_NUM, "price" },
+};
+
+static const field_t fields_student[] = {
+  [STUDENT_ID] = { TYP_STR, "id" },
+  [STUDENT_USER] = { TYP_STR, "user" },
+  [STUDENT_PASS] = { TYP_STR, "pass" },
+  [STUDENT_NAME] = { TYP_STR, "name" },
+  [STUDENT_NUMBER] = { TYP_STR, "number" },
+};
+
+static const field_t fields_merchant[] = {
+  [MERCHANT_USER] = { TYP_STR, "user" },
+  [MERCHANT_PASS] = { TYP_STR, "pass" },
+  [MERCHANT_NAME] = { TYP_STR, "name" },
+  [MERCHANT_NUMBER] = { TYP_STR, "number" },
+  [MERCHANT_POSITION] = { TYP_STR, "position" },
+};
+
+static const field_t fields_evaluation[] = {
+  [EVA_ID] = { TYP_INT, "id" },
+  [EVA_USER] = { TYP_STR, "user" },
+  [EVA_GRADE] = { TYP_NUM, "grade" },
+  [EVA_EVALUATION] = { TYP_STR, "evaluation" },
+};
+
+#define FIELDS(ARR) .nfield = sizeof (ARR) / sizeof (field_t), .fields = (ARR)
+
+/* rows are identified in the log by their primary key */
+table_t tables[TABLE_NUM] = {
+  [TABLE_MENU] = { .name = "menu",
+		   .path = PATH_TABLE_MENU,
+		   .snap = PATH_SNAP_MENU,
+		   FIELDS (fields_menu),
+		   .nkey = 1,
+		   .keys = { MENU_ID } },
+  [TABLE_STUDENT] = { .name = "student",
+		      .path = PATH_TABLE_STUDENT,
+		      .snap = PATH_SNAP_STUDENT,
+		      FIELDS (fields_student),
+		      .nkey = 1,
+		      .keys = { STUDENT_USER } },
+  [TABLE_MERCHANT] = { .name = "merchant",
+		       .path = PATH_TABLE_MERCHANT,
+		       .snap = PATH_SNAP_MERCHANT,
+		       FIELDS (fields_merchant),
+		       .nkey = 1,
+		       .keys = { MERCHANT_USER } },
+  [TABLE_EVALUATION] = { .name = "evaluation",
+			 .path = PATH_TABLE_EVALUATION,
+			 .snap = PATH_SNAP_EVALUATION,
+			 FIELDS (fields_evaluation),
+			 .nkey = 2,
+			 .keys = { EVA_ID, EVA_USER } },
+};
 
 static inline FILE *
 load_file (const char *path)
@@ -24,105 +137,1074 @@ load_file (const char *path)
   return file;
 }
 
-static inline json_t *
-load_table (FILE *file)
+/* the json files are read one array element at a time, only the current
+   record is ever parsed, so importing needs no dom of the whole table */
+typedef struct
+{
+  FILE *file;
+  size_t pos;
+  size_t size;
+  bool first;
+
+  char *buf;
+  size_t len;
+  size_t cap;
+} reader_t;
+
+static inline int
+reader_getc (reader_t *rd)
+{
+  int c = getc_unlocked (rd->file);
+  rd->pos++;
+  return c;
+}
+
+static inline int
+reader_skip (reader_t *rd)
+{
+  int c;
+  while (isspace (c = reader_getc (rd)))
+    ;
+  return c;
+}
+
+static inline void
+reader_push (reader_t *rd, char c)
+{
+  if (rd->len >= rd->cap)
+    {
+      size_t cap = rd->cap ? rd->cap * 2 : 256;
+      char *buf = realloc (rd->buf, cap);
+      if (!buf)
+	error ("内存不足");
+      rd->buf = buf;
+      rd->cap = cap;
+    }
+  rd->buf[rd->len++] = c;
+}
+
+/* copy the next object of the top-level array into RD->buf, false once
+   the closing bracket is reached */
+static inline bool
+reader_next (reader_t *rd)
+{
+  int c = reader_skip (rd);
+
+  if (rd->first)
+    {
+      if (c != '[')
+	error ("json 格式错误");
+      c = reader_skip (rd);
+      if (c == ']')
+	return false;
+      rd->first = false;
+    }
+  else if (c == ']')
+    return false;
+  else if (c == ',')
+    c = reader_skip (rd);
+  else
+    error ("json 格式错误");
+
+  if (c != '{')
+    error ("json 格式错误");
+
+  int depth = 0;
+  bool str = false, esc = false;
+
+  for (rd->len = 0;; c = reader_getc (rd))
+    {
+      if (c == EOF)
+	error ("json 格式错误");
+
+      reader_push (rd, c);
+
+      if (str)
+	{
+	  if (esc)
+	    esc = false;
+	  else if (c == '\\')
+	    esc = true;
+	  else if (c == '"')
+	    str = false;
+	}
+      else if (c == '"')
+	str = true;
+      else if (c == '{' || c == '[')
+	depth++;
+      else if ((c == '}' || c == ']') && --depth == 0)
+	return true;
+    }
+}
+
+static inline json_kind_t
+field_kind (int typ)
+{
+  switch (typ)
+    {
+    case TYP_INT:
+      return JSON_INT;
+    case TYP_NUM:
+      return JSON_NUM;
+    default:
+      return JSON_STR;
+    }
+}
+
+static inline void
+load_table (FILE *file, table_t *tbl)
 {
   if (fseek (file, 0, SEEK_SET) != 0)
     error ("文件流重定位失败");
 
-  json_t *json;
-  json_error_t jerr;
+  struct stat st;
+  if (fstat (fileno (file), &st) != 0)
+    error ("数据表 %s 读取失败", tbl->path);
 
-  json = json_loadf (file, 0, &jerr);
-  if (!json)
-    error ("json 解析失败");
+  /* every column is read straight into its slot of VALS */
+  json_field_t cols[FIELD_MAX];
+  for (size_t j = 0; j < tbl->nfield; j++)
+    {
+      const field_t *field = tbl->fields + j;
+      cols[j] = (json_field_t){ .key = field->key,
+				.len = strlen (field->key),
+				.kind = field_kind (field->typ),
+				.off = j * sizeof (value_t) };
+    }
 
-  if (!json_is_array (json))
-    error ("json 格式错误");
+  reader_t rd = { .file = file, .size = st.st_size, .first = true };
 
+  while (reader_next (&rd))
+    {
+      value_t vals[FIELD_MAX];
+
+      switch (json_decode (rd.buf, rd.len, cols, tbl->nfield, vals))
+	{
+	case JSON_BAD:
+	  error ("json 解析失败");
+	case JSON_MISSING:
+	  error ("json 格式错误");
+	}
+
+      if (!table_append (tbl, vals, NULL))
+	error ("内存不足");
+
+      arena_reset ();
+
+      if (tbl->num % LOAD_REPORT == 0)
+	fprintf (stderr, "数据表 %s: 已导入 %zu 行 (%zu%%)\n", tbl->name,
+		 tbl->num, rd.size ? rd.pos * 100 / rd.size : 100);
+    }
+
+  free (rd.buf);
   fclose (file);
-  return json;
 }
 
-void
-table_init ()
+static inline uint64_t
+now_us (void)
 {
-  table_menu = load_table (load_file (PATH_TABLE_MENU));
-  table_student = load_table (load_file (PATH_TABLE_STUDENT));
-  table_merchant = load_table (load_file (PATH_TABLE_MERCHANT));
-  table_evaluation = load_table (load_file (PATH_TABLE_EVALUATION));
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-find_ret_t
-find_by (json_t *tbl, find_pair_t *cnd, size_t num)
+/* one thread per table, the tables share nothing but the symbol table
+   until the indexes are built */
+static void *
+load_run (void *arg)
 {
-  find_ret_t ret = { .item = NULL };
-  size_t size = json_array_size (tbl);
+  table_t *tbl = arg;
+  uint64_t start = now_us ();
 
-  json_int_t ival;
-  const char *sval;
-  json_t *temp, *item;
+  if (!table_reserve (tbl, TABLE_INIT_CAP))
+    error ("内存不足");
 
-  for (size_t i = 0; i < size; i++)
+  bool snap = snap_load (tbl);
+  if (!snap)
     {
-      if (!(item = json_array_get (tbl, i)))
-	error ("json 格式损坏");
+      load_table (load_file (tbl->path), tbl);
+      tbl->dirty = true;
+    }
 
-      for (size_t j = 0; j < num; j++)
-	{
-	  find_pair_t *pair = cnd + j;
+  arena_release ();
 
-	  if (!(temp = json_object_get (item, pair->key)))
-	    error ("不存在键 %s", pair->key);
+  fprintf (stderr, "数据表 %s: %zu 行, 耗时 %.1f ms (%s)\n", tbl->name,
+	   tbl->num, (now_us () - start) / 1000.0, snap ? "快照" : "json");
+  return NULL;
+}
 
-	  if (pair->typ == TYP_INT)
-	    {
-	      if (!json_is_integer (temp))
-		error ("类型不匹配");
-	      ival = json_integer_value (temp);
-	      if (pair->val.ival != ival)
-		goto next;
-	    }
-	  else if (pair->typ == TYP_STR)
+static inline size_t
+hash_int (uint64_t ival)
+{
+  uint64_t hash = ival + 0x9e3779b97f4a7c15ULL;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 31);
+}
+
+static inline cell_t
+row_cell (table_t *tbl, size_t row, int col)
+{
+  switch (tbl->fields[col].typ)
+    {
+    case TYP_INT:
+      return (cell_t){ .ival = COL_INT (tbl, col, row) };
+    case TYP_NUM:
+      return (cell_t){ .nval = COL_NUM (tbl, col, row) };
+    default:
+      return (cell_t){ .sym = COL_SYM (tbl, col, row) };
+    }
+}
+
+static inline bool
+cell_eq (int typ, cell_t c1, cell_t c2)
+{
+  switch (typ)
+    {
+    case TYP_INT:
+      return c1.ival == c2.ival;
+    case TYP_NUM:
+      return c1.nval == c2.nval;
+    default:
+      return c1.sym == c2.sym;
+    }
+}
+
+static inline size_t
+cell_hash (int typ, cell_t cell)
+{
+  uint64_t bits;
+  switch (typ)
+    {
+    case TYP_INT:
+      return hash_int (cell.ival);
+    case TYP_NUM:
+      memcpy (&bits, &cell.nval, sizeof (bits));
+      return hash_int (bits);
+    default:
+      return hash_int (cell.sym);
+    }
+}
+
+/* a string that was never interned cannot be stored in any row */
+static inline bool
+cnd_cells (table_t *tbl, find_pair_t *cnd, size_t num, cell_t *cells)
+{
+  for (size_t i = 0; i < num; i++)
+    switch (tbl->fields[cnd[i].col].typ)
+      {
+      case TYP_INT:
+	cells[i].ival = cnd[i].val.ival;
+	break;
+      case TYP_NUM:
+	cells[i].nval = cnd[i].val.nval;
+	break;
+      default:
+	if (!(cells[i].sym = sym_find (cnd[i].val.sval)))
+	  return false;
+      }
+  return true;
+}
+
+static inline bool
+row_match (table_t *tbl, size_t row, find_pair_t *cnd, cell_t *cells,
+	   size_t num)
+{
+  for (size_t i = 0; i < num; i++)
+    {
+      int col = cnd[i].col;
+      if (!cell_eq (tbl->fields[col].typ, cells[i], row_cell (tbl, row, col)))
+	return false;
+    }
+  return true;
+}
+
+/* CELLS come in index order, a multiply-add keeps (a, b) apart from
+   (b, a) and equal keys from cancelling out the way xor would */
+static inline size_t
+index_hash (index_t *idx, cell_t *cells)
+{
+  size_t hash = 0;
+  for (size_t i = 0; i < idx->num; i++)
+    hash = hash * 0x9e3779b97f4a7c15ULL
+	   + cell_hash (idx->tbl->fields[idx->cols[i]].typ, cells[i]);
+  return hash;
+}
+
+static inline size_t
+row_hash (index_t *idx, size_t row)
+{
+  cell_t cells[TABLE_KEYS];
+  for (size_t i = 0; i < idx->num; i++)
+    cells[i] = row_cell (idx->tbl, row, idx->cols[i]);
+  return index_hash (idx, cells);
+}
+
+static inline bool
+index_has (index_t *idx, int col)
+{
+  for (size_t i = 0; i < idx->num; i++)
+    if (idx->cols[i] == col)
+      return true;
+  return false;
+}
+
+/* an index serves CND when it covers exactly the same columns, in any
+   order, KEYS receives CELLS in index order */
+static inline index_t *
+index_get (table_t *tbl, find_pair_t *cnd, size_t num, cell_t *cells,
+	   cell_t *keys)
+{
+  for (size_t i = 0; i < index_num; i++)
+    {
+      index_t *idx = indexes + i;
+      if (idx->tbl != tbl || idx->num != num)
+	continue;
+
+      size_t hit = 0;
+      for (size_t j = 0; j < idx->num; j++)
+	for (size_t k = 0; k < num; k++)
+	  if (cnd[k].col == idx->cols[j])
 	    {
-	      if (!json_is_string (temp))
-		error ("类型不匹配");
-	      sval = json_string_value (temp);
-	      if (0 != strcmp (pair->val.sval, sval))
-		goto next;
+	      keys[j] = cells[k];
+	      hit++;
+	      break;
 	    }
-	  else
-	    error ("未知类型 %d", pair->typ);
-	}
 
-      ret.item = item;
-      ret.index = i;
-      goto ret;
+      if (hit == num)
+	return idx;
+    }
+  return NULL;
+}
+
+static inline void
+index_rehash (index_t *idx, size_t cap)
+{
+  index_node **buckets;
+  if (!(buckets = calloc (cap, sizeof (index_node *))))
+    error ("内存不足");
+
+  for (size_t i = 0; i < idx->cap; i++)
+    for (index_node *node = idx->buckets[i], *next; node; node = next)
+      {
+	next = node->next;
+	size_t slot = node->hash & (cap - 1);
+	node->next = buckets[slot];
+	buckets[slot] = node;
+      }
+
+  free (idx->buckets);
+  idx->buckets = buckets;
+  idx->cap = cap;
+}
+
+static inline bool
+index_insert (index_t *idx, size_t pos)
+{
+  index_node *node;
+  if (!(node = malloc (sizeof (index_node))))
+    return false;
+
+  if (idx->size >= idx->cap)
+    index_rehash (idx, idx->cap * 2);
+
+  node->pos = pos;
+  node->hash = row_hash (idx, pos);
+
+  size_t slot = node->hash & (idx->cap - 1);
+  node->next = idx->buckets[slot];
+  idx->buckets[slot] = node;
+  idx->size++;
+  return true;
+}
+
+static inline void
+index_erase (index_t *idx, size_t pos)
+{
+  size_t hash = row_hash (idx, pos);
+  index_node **link = idx->buckets + (hash & (idx->cap - 1));
+
+  for (index_node *node; (node = *link); link = &node->next)
+    if (node->pos == pos)
+      {
+	*link = node->next;
+	idx->size--;
+	free (node);
+	return;
+      }
+
+  error ("索引损坏");
+}
+
+static inline index_node *
+index_next (index_t *idx, index_node *node, size_t hash, find_pair_t *cnd,
+	    cell_t *cells, size_t num)
+{
+  for (; node; node = node->next)
+    if (node->hash == hash && row_match (idx->tbl, node->pos, cnd, cells, num))
+      return node;
+  return NULL;
+}
+
+static inline void
+index_add (table_t *tbl, const int *cols, size_t num)
+{
+  if (index_num >= INDEX_MAX || num > TABLE_KEYS)
+    error ("索引数量超出上限");
+
+  index_t *idx = indexes + index_num++;
+  *idx = (index_t){ .num = num, .tbl = tbl };
+  memcpy (idx->cols, cols, num * sizeof (int));
+
+  index_rehash (idx, INDEX_INIT_CAP);
+
+  for (size_t i = 0; i < tbl->num; i++)
+    if (ROW_LIVE (tbl, i) && !index_insert (idx, i))
+      error ("内存不足");
+}
+
+#define INDEX_ADD1(TBL, COL1)                                                 \
+  do                                                                          \
+    {                                                                         \
+      int cols[] = { (COL1) };                                                \
+      index_add ((TBL), cols, 1);                                             \
+    }                                                                         \
+  while (0)
+
+#define INDEX_ADD2(TBL, COL1, COL2)                                           \
+  do                                                                          \
+    {                                                                         \
+      int cols[] = { (COL1), (COL2) };                                        \
+      index_add ((TBL), cols, 2);                                             \
+    }                                                                         \
+  while (0)
+
+bool
+table_reserve (table_t *tbl, size_t cap)
+{
+  if (cap <= tbl->cap)
+    return true;
 
-    next:
-      continue;
+  for (size_t i = 0; i < tbl->nfield; i++)
+    {
+      size_t width = tbl->fields[i].typ == TYP_STR ? sizeof (sym_t) : 8;
+      void *col = realloc (tbl->cols[i].ints, cap * width);
+      if (!col)
+	return false;
+      tbl->cols[i].ints = col;
     }
 
-ret:
-  return ret;
+  bool *dead = realloc (tbl->dead, cap * sizeof (bool));
+  if (!dead)
+    return false;
+  tbl->dead = dead;
+
+  uint64_t *ids = realloc (tbl->ids, cap * sizeof (uint64_t));
+  if (!ids)
+    return false;
+  tbl->ids = ids;
+
+  tbl->cap = cap;
+  return true;
+}
+
+/* the binary snapshot is authoritative, the json file is only imported
+   while no snapshot has been written yet */
+void
+table_init ()
+{
+  uint64_t start = now_us ();
+  pthread_t threads[TABLE_NUM];
+  bool started[TABLE_NUM];
+
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    started[i] = !pthread_create (threads + i, NULL, load_run, tables + i);
+
+  /* a table whose thread could not be started is loaded right here */
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    if (!started[i])
+      load_run (tables + i);
+    else if (0 != pthread_join (threads[i], NULL))
+      error ("加载线程等待失败");
+
+  INDEX_ADD1 (table_menu, MENU_ID);
+  INDEX_ADD1 (table_menu, MENU_USER);
+  INDEX_ADD1 (table_student, STUDENT_ID);
+  INDEX_ADD1 (table_student, STUDENT_USER);
+  INDEX_ADD1 (table_merchant, MERCHANT_USER);
+  INDEX_ADD1 (table_merchant, MERCHANT_NAME);
+  INDEX_ADD1 (table_evaluation, EVA_ID);
+  INDEX_ADD2 (table_evaluation, EVA_ID, EVA_USER);
+  INDEX_ADD1 (table_evaluation, EVA_USER);
+
+  log_init ();
+
+  if (!table_checkpoint ())
+    error ("检查点写入失败");
+
+  fprintf (stderr, "数据表加载完成, 共耗时 %.1f ms\n",
+	   (now_us () - start) / 1000.0);
+}
+
+void
+table_rdlock (void)
+{
+  pthread_rwlock_rdlock (&lock);
 }
 
+void
+table_wrlock (void)
+{
+  pthread_rwlock_wrlock (&lock);
+}
+
+void
+table_unlock (void)
+{
+  pthread_rwlock_unlock (&lock);
+}
+
+/* reap the snapshot child, the tables it was saving are dirty again if
+   it failed */
+static inline void
+bgsave_reap (bool wait)
+{
+  if (!bgsave.pid)
+    return;
+
+  int status;
+  pid_t ret = waitpid (bgsave.pid, &status, wait ? 0 : WNOHANG);
+  if (!ret)
+    return;
+
+  bgsave.pid = 0;
+  if (ret > 0 && WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS)
+    {
+      log_drop ();
+      return;
+    }
+
+  fprintf (stderr, "后台快照写入失败\n");
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    tables[i].dirty |= bgsave.dirty[i];
+}
+
+/* the dirty tables are saved by a forked child from its copy-on-write
+   view while this process keeps serving, at most one runs at a time */
 bool
-save (json_t *from, const char *to)
+table_bgsave (void)
 {
-  char *str = json_dumps (from, JSON_INDENT (2));
-  if (!str)
+  bgsave_reap (false);
+  if (bgsave.pid)
+    return true;
+
+  bool dirty = false;
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    dirty |= tables[i].dirty;
+
+  if (!dirty)
+    return true;
+
+  log_sync ();
+  if (!log_rotate ())
     return false;
 
-  FILE *file = fopen (to, "w+");
-  if (!file)
+  pid_t pid = fork ();
+  if (pid < 0)
+    return false;
+
+  if (!pid)
+    {
+      for (size_t i = 0; i < TABLE_NUM; i++)
+	if (tables[i].dirty && !snap_save (tables + i))
+	  _exit (EXIT_FAILURE);
+      _exit (EXIT_SUCCESS);
+    }
+
+  bgsave.pid = pid;
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    {
+      bgsave.dirty[i] = tables[i].dirty;
+      tables[i].dirty = false;
+    }
+
+  return true;
+}
+
+/* the log may only be dropped once every table it touched is on disk */
+bool
+table_checkpoint (void)
+{
+  bgsave_reap (true);
+
+  bool dirty = false;
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    dirty |= tables[i].dirty;
+
+  if (!dirty)
+    return true;
+
+  log_sync ();
+
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    {
+      table_t *tbl = tables + i;
+      if (!tbl->dirty)
+	continue;
+
+      if (!snap_save (tbl))
+	return false;
+
+      tbl->dirty = false;
+    }
+
+  return log_reset ();
+}
+
+/* the members of ROW, written into the object open in OUT */
+void
+table_row (json_out_t *out, table_t *tbl, size_t row)
+{
+  for (size_t i = 0; i < tbl->nfield; i++)
+    {
+      json_out_key (out, tbl->fields[i].key);
+      switch (tbl->fields[i].typ)
+	{
+	case TYP_INT:
+	  json_out_int (out, COL_INT (tbl, i, row));
+	  break;
+	case TYP_NUM:
+	  json_out_num (out, COL_NUM (tbl, i, row));
+	  break;
+	default:
+	  json_out_str (out, COL_STR (tbl, i, row),
+			sym_len (COL_SYM (tbl, i, row)));
+	}
+    }
+}
+
+/* write aside and rename, so a crash never leaves a half-written table */
+static inline bool
+save (table_t *from, const char *to)
+{
+  char tmp[PATH_MAX];
+  if (snprintf (tmp, sizeof (tmp), "%s.tmp", to) >= (int) sizeof (tmp))
     return false;
 
-  size_t len = strlen (str);
-  if (fwrite (str, len, 1, file) != 1)
+  FILE *file = fopen (tmp, "w+");
+  if (!file)
     return false;
 
+  json_out_t *out;
+  if (!(out = json_out_file (file)))
+    goto err;
+
+  json_out_arr (out);
+  for (size_t i = 0; i < from->num; i++)
+    if (ROW_LIVE (from, i))
+      {
+	json_out_obj (out);
+	table_row (out, from, i);
+	json_out_end (out);
+      }
+  json_out_end (out);
+
+  if (!json_out_flush (out) || fsync (fileno (file)) != 0)
+    goto err;
+
+  return fclose (file) == 0 && rename (tmp, to) == 0;
+
+err:
   fclose (file);
-  free (str);
+  return false;
+}
+
+bool
+table_export (void)
+{
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    if (!save (tables + i, tables[i].path))
+      return false;
+  return true;
+}
+
+/* room for one more row, after which table_append cannot fail */
+bool
+table_grow (table_t *tbl)
+{
+  return tbl->num < tbl->cap || table_reserve (tbl, tbl->cap * 2);
+}
+
+/* always into a new slot at the end, the ones freed by table_remove
+   only come back through table_compact; ROW may be NULL */
+bool
+table_append (table_t *tbl, const value_t *vals, size_t *row)
+{
+  if (!table_grow (tbl))
+    return false;
+  size_t pos = tbl->num++;
+
+  for (size_t i = 0; i < tbl->nfield; i++)
+    switch (tbl->fields[i].typ)
+      {
+      case TYP_INT:
+	COL_INT (tbl, i, pos) = vals[i].ival;
+	break;
+      case TYP_NUM:
+	COL_NUM (tbl, i, pos) = vals[i].nval;
+	break;
+      default:
+	COL_SYM (tbl, i, pos) = sym_intern (vals[i].sval);
+      }
+
+  tbl->dead[pos] = false;
+  tbl->ids[pos] = ++tbl->last_id;
+
+  for (size_t i = 0; i < index_num; i++)
+    if (indexes[i].tbl == tbl && !index_insert (indexes + i, pos))
+      error ("内存不足");
+
+  int key = tbl->keys[0];
+  if (tbl->fields[key].typ == TYP_INT && vals[key].ival >= tbl->serial)
+    tbl->serial = vals[key].ival + 1;
+
+  tbl->version++;
+  if (row)
+    *row = pos;
+  return true;
+}
+
+/* O(1): the row becomes a tombstone, no other row id changes */
+bool
+table_remove (table_t *tbl, size_t index)
+{
+  if (index >= tbl->num || !ROW_LIVE (tbl, index))
+    return false;
+
+  for (size_t i = 0; i < index_num; i++)
+    if (indexes[i].tbl == tbl)
+      index_erase (indexes + i, index);
+
+  for (size_t i = 0; i < tbl->nfield; i++)
+    if (tbl->fields[i].typ == TYP_STR)
+      sym_unref (COL_SYM (tbl, i, index));
+
+  tbl->dead[index] = true;
+  tbl->nfree++;
+  tbl->version++;
+  return true;
+}
+
+/* the live row at FROM goes down to the dead slot TO, with its id */
+static inline void
+move_row (table_t *tbl, size_t from, size_t to)
+{
+  for (size_t i = 0; i < index_num; i++)
+    if (indexes[i].tbl == tbl)
+      index_erase (indexes + i, from);
+
+  for (size_t i = 0; i < tbl->nfield; i++)
+    if (tbl->fields[i].typ == TYP_STR)
+      COL_SYM (tbl, i, to) = COL_SYM (tbl, i, from);
+    else
+      COL_INT (tbl, i, to) = COL_INT (tbl, i, from);
+
+  tbl->ids[to] = tbl->ids[from];
+  tbl->dead[to] = false;
+  tbl->dead[from] = true;
+
+  for (size_t i = 0; i < index_num; i++)
+    if (indexes[i].tbl == tbl && !index_insert (indexes + i, to))
+      error ("内存不足");
+}
+
+/* squeeze the tombstones out, keeping the order of the live rows, but
+   look at no more than BUDGET slots; returns what is left of it */
+static inline size_t
+squeeze (table_t *tbl, size_t budget,
+	 void (*move) (table_t *tbl, size_t from, size_t to))
+{
+  if (!tbl->squeezing)
+    {
+      tbl->squeezing = true;
+      tbl->squeeze_to = tbl->squeeze_from = 0;
+    }
+
+  for (; budget && tbl->squeeze_from < tbl->num; budget--)
+    {
+      size_t from = tbl->squeeze_from++;
+      if (!ROW_LIVE (tbl, from))
+	continue;
+
+      size_t to = tbl->squeeze_to++;
+      if (to == from)
+	continue;
+
+      move_row (tbl, from, to);
+      if (move)
+	move (tbl, from, to);
+    }
+
+  if (tbl->squeeze_from < tbl->num)
+    return budget;
+
+  /* rows appended meanwhile went to the end and were moved as well */
+  tbl->nfree -= tbl->num - tbl->squeeze_to;
+  tbl->num = tbl->squeeze_to;
+  tbl->squeezing = false;
+  return budget;
+}
+
+/* moves rows, so it must run between requests, never inside one, in
+   slices of COMPACT_SLICE slots under the write lock; MOVE is told of
+   every row that changed its slot, returns whether one is in progress */
+bool
+table_compact (void (*move) (table_t *tbl, size_t from, size_t to))
+{
+  size_t budget = COMPACT_SLICE;
+  for (size_t i = 0; budget && i < TABLE_NUM; i++)
+    {
+      table_t *tbl = tables + i;
+      if (tbl->squeezing
+	  || (tbl->nfree >= COMPACT_MIN && tbl->nfree * 4 >= tbl->num))
+	budget = squeeze (tbl, budget, move);
+    }
+
+  for (size_t i = 0; i < TABLE_NUM; i++)
+    if (tables[i].squeezing)
+      return true;
+  return false;
+}
+
+bool
+table_set (table_t *tbl, size_t index, int col, value_t val)
+{
+  if (index >= tbl->num || !ROW_LIVE (tbl, index)
+      || (size_t) col >= tbl->nfield)
+    return false;
+
+  size_t num = 0;
+  index_t *idx[INDEX_MAX];
+
+  for (size_t i = 0; i < index_num; i++)
+    if (indexes[i].tbl == tbl && index_has (indexes + i, col))
+      idx[num++] = indexes + i;
+
+  for (size_t i = 0; i < num; i++)
+    index_erase (idx[i], index);
+
+  switch (tbl->fields[col].typ)
+    {
+    case TYP_INT:
+      COL_INT (tbl, col, index) = val.ival;
+      break;
+    case TYP_NUM:
+      COL_NUM (tbl, col, index) = val.nval;
+      break;
+    default:
+      {
+	sym_t old = COL_SYM (tbl, col, index);
+	COL_SYM (tbl, col, index) = sym_intern (val.sval);
+	sym_unref (old);
+      }
+    }
+
+  for (size_t i = 0; i < num; i++)
+    if (!index_insert (idx[i], index))
+      error ("内存不足");
+
+  tbl->version++;
+  return true;
+}
+
+/* the fields of the live row INDEX, its strings stay valid for as long
+   as the row keeps them */
+void
+table_get (table_t *tbl, size_t index, value_t *vals)
+{
+  for (size_t i = 0; i < tbl->nfield; i++)
+    switch (tbl->fields[i].typ)
+      {
+      case TYP_INT:
+	vals[i].ival = COL_INT (tbl, i, index);
+	break;
+      case TYP_NUM:
+	vals[i].nval = COL_NUM (tbl, i, index);
+	break;
+      default:
+	vals[i].sval = COL_STR (tbl, i, index);
+      }
+}
+
+/* every field of the live row INDEX at once, VALS may hold strings from
+   table_get on the same row */
+void
+table_update (table_t *tbl, size_t index, const value_t *vals)
+{
+  for (size_t i = 0; i < index_num; i++)
+    if (indexes[i].tbl == tbl)
+      index_erase (indexes + i, index);
+
+  for (size_t i = 0; i < tbl->nfield; i++)
+    switch (tbl->fields[i].typ)
+      {
+      case TYP_INT:
+	COL_INT (tbl, i, index) = vals[i].ival;
+	break;
+      case TYP_NUM:
+	COL_NUM (tbl, i, index) = vals[i].nval;
+	break;
+      default:
+	{
+	  sym_t old = COL_SYM (tbl, i, index);
+	  COL_SYM (tbl, i, index) = sym_intern (vals[i].sval);
+	  sym_unref (old);
+	}
+      }
+
+  for (size_t i = 0; i < index_num; i++)
+    if (indexes[i].tbl == tbl && !index_insert (indexes + i, index))
+      error ("内存不足");
+
+  tbl->version++;
+}
+
+find_ret_t
+find_by (table_t *tbl, find_pair_t *cnd, size_t num)
+{
+  find_ret_t ret = { .found = false };
+
+  index_t *idx;
+  cell_t cells[TABLE_KEYS], keys[TABLE_KEYS];
+
+  if (num > TABLE_KEYS)
+    error ("查询条件过多");
+
+  if (!cnd_cells (tbl, cnd, num, cells))
+    return ret;
+
+  if ((idx = index_get (tbl, cnd, num, cells, keys)))
+    {
+      size_t hash = index_hash (idx, keys);
+      index_node *node = idx->buckets[hash & (idx->cap - 1)];
+
+      if ((node = index_next (idx, node, hash, cnd, cells, num)))
+	{
+	  ret.found = true;
+	  ret.index = node->pos;
+	}
+
+      return ret;
+    }
+
+  for (size_t i = 0; i < tbl->num; i++)
+    if (ROW_LIVE (tbl, i) && row_match (tbl, i, cnd, cells, num))
+      {
+	ret.found = true;
+	ret.index = i;
+	break;
+      }
+
+  return ret;
+}
+
+static inline bool
+find_push (find_all_t *ret, size_t row)
+{
+  if (ret->num >= ret->cap)
+    {
+      size_t cap = ret->cap ? ret->cap * 2 : 8;
+      size_t *rows = realloc (ret->rows, cap * sizeof (size_t));
+      if (!rows)
+	return false;
+
+      ret->rows = rows;
+      ret->cap = cap;
+    }
+
+  ret->rows[ret->num++] = row;
+  return true;
+}
+
+static int
+find_cmp (const void *p1, const void *p2)
+{
+  size_t r1 = *(const size_t *) p1, r2 = *(const size_t *) p2;
+  return (r1 > r2) - (r1 < r2);
+}
+
+/* RET->rows is owned by the caller, in table order either way */
+bool
+find_all (table_t *tbl, find_pair_t *cnd, size_t num, find_all_t *ret)
+{
+  *ret = (find_all_t){ .num = 0 };
+
+  index_t *idx;
+  cell_t cells[TABLE_KEYS], keys[TABLE_KEYS];
+
+  if (num > TABLE_KEYS)
+    error ("查询条件过多");
+
+  if (!cnd_cells (tbl, cnd, num, cells))
+    return true;
+
+  if ((idx = index_get (tbl, cnd, num, cells, keys)))
+    {
+      size_t hash = index_hash (idx, keys);
+      index_node *node = idx->buckets[hash & (idx->cap - 1)];
+
+      for (; (node = index_next (idx, node, hash, cnd, cells, num));
+	   node = node->next)
+	if (!find_push (ret, node->pos))
+	  goto err;
+
+      qsort (ret->rows, ret->num, sizeof (size_t), find_cmp);
+      return true;
+    }
+
+  for (size_t i = 0; i < tbl->num; i++)
+    if (ROW_LIVE (tbl, i) && row_match (tbl, i, cnd, cells, num)
+	&& !find_push (ret, i))
+      goto err;
+
+  return true;
+
+err:
+  free (ret->rows);
+  *ret = (find_all_t){ .num = 0 };
+  return false;
+}
+
+/* the first slot whose id is ID or above, or the table size; the ids
+   rise with the slot except across the gap of a compaction in progress,
+   whose slots are all dead */
+size_t
+find_from (table_t *tbl, uint64_t id)
+{
+  size_t gap = tbl->squeezing ? tbl->squeeze_to : tbl->num;
+  size_t skip = tbl->squeezing ? tbl->squeeze_from - gap : 0;
+  size_t lo = 0, hi = tbl->num - skip;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (ROW_ID (tbl, mid < gap ? mid : mid + skip) < id)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return lo < gap ? lo : lo + skip;
+}
+
+/* the slot of id ID, if its row is still live */
+bool
+find_id (table_t *tbl, uint64_t id, size_t *row)
+{
+  size_t pos = find_from (tbl, id);
+  if (pos == tbl->num || ROW_ID (tbl, pos) != id || !ROW_LIVE (tbl, pos))
+    return false;
+
+  *row = pos;
   return true;
 }
@@ -1,46 +1,197 @@
 #ifndef TABLE_H
 #define TABLE_H
 
-#include <jansson.h>
+#include "json.h"
+#include "sym.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 #define PATH_TABLE_MENU "./data/menu.json"
 #define PATH_TABLE_STUDENT "./data/student.json"
 #define PATH_TABLE_MERCHANT "./data/merchant.json"
 #define PATH_TABLE_EVALUATION "./data/evaluation.json"
+#define PATH_TABLE_LOG "./data/table.log"
+#define PATH_TABLE_LOG_OLD "./data/table.log.old"
 
-extern json_t *table_menu;
-extern json_t *table_student;
-extern json_t *table_merchant;
-extern json_t *table_evaluation;
+#define PATH_SNAP_MENU "./data/menu.bin"
+#define PATH_SNAP_STUDENT "./data/student.bin"
+#define PATH_SNAP_MERCHANT "./data/merchant.bin"
+#define PATH_SNAP_EVALUATION "./data/evaluation.bin"
+
+#define FIELD_MAX 8
+#define TABLE_KEYS 2
 
 enum
 {
   TYP_INT,
   TYP_STR,
+  TYP_NUM,
+};
+
+enum
+{
+  TABLE_MENU,
+  TABLE_STUDENT,
+  TABLE_MERCHANT,
+  TABLE_EVALUATION,
+  TABLE_NUM,
+};
+
+enum
+{
+  MENU_ID,
+  MENU_NAME,
+  MENU_USER,
+  MENU_PRICE,
 };
 
+enum
+{
+  STUDENT_ID,
+  STUDENT_USER,
+  STUDENT_PASS,
+  STUDENT_NAME,
+  STUDENT_NUMBER,
+};
+
+enum
+{
+  MERCHANT_USER,
+  MERCHANT_PASS,
+  MERCHANT_NAME,
+  MERCHANT_NUMBER,
+  MERCHANT_POSITION,
+};
+
+enum
+{
+  EVA_ID,
+  EVA_USER,
+  EVA_GRADE,
+  EVA_EVALUATION,
+};
+
+typedef struct
+{
+  int typ;
+  const char *key;
+} field_t;
+
 typedef union
 {
   json_int_t ival;
+  double nval;
   const char *sval;
-} find_val_t;
+} value_t;
+
+/* one contiguous array per field, strings are stored interned */
+typedef union
+{
+  json_int_t *ints;
+  double *nums;
+  sym_t *syms;
+} column_t;
 
 typedef struct
 {
-  int typ;
-  find_val_t val;
-  const char *key;
+  const char *name;
+  const char *path;
+  const char *snap;
+
+  size_t nfield;
+  const field_t *fields;
+
+  size_t nkey;
+  int keys[TABLE_KEYS];
+
+  /* a row keeps its slot until a compaction moves it down, removed rows
+     are left as tombstones and new ones always go to the end */
+  size_t num;
+  size_t cap;
+  column_t cols[FIELD_MAX];
+
+  bool *dead;
+  size_t nfree;
+
+  /* the id of the row in each slot, handed out in slot order and never
+     reused, so a row is found again after a compaction by its id */
+  uint64_t *ids;
+  uint64_t last_id;
+
+  /* a compaction in progress has moved the live rows below SQUEEZE_FROM
+     down below SQUEEZE_TO, every slot between the two is dead */
+  bool squeezing;
+  size_t squeeze_to;
+  size_t squeeze_from;
+
+  /* next unused value of an integer primary key */
+  json_int_t serial;
+
+  /* bumped by every change to the rows, for whatever was derived from
+     them */
+  uint64_t version;
+
+  bool dirty;
+} table_t;
+
+extern table_t tables[TABLE_NUM];
+
+#define table_menu (tables + TABLE_MENU)
+#define table_student (tables + TABLE_STUDENT)
+#define table_merchant (tables + TABLE_MERCHANT)
+#define table_evaluation (tables + TABLE_EVALUATION)
+
+#define COL_INT(TBL, COL, ROW) ((TBL)->cols[(COL)].ints[(ROW)])
+#define COL_NUM(TBL, COL, ROW) ((TBL)->cols[(COL)].nums[(ROW)])
+#define COL_SYM(TBL, COL, ROW) ((TBL)->cols[(COL)].syms[(ROW)])
+#define COL_STR(TBL, COL, ROW) sym_str (COL_SYM ((TBL), (COL), (ROW)))
+
+#define ROW_LIVE(TBL, ROW) (!(TBL)->dead[(ROW)])
+#define ROW_ID(TBL, ROW) ((TBL)->ids[(ROW)])
+
+typedef struct
+{
+  int col;
+  value_t val;
 } find_pair_t;
 
 typedef struct
 {
-  json_t *item;
+  bool found;
   size_t index;
 } find_ret_t;
 
+typedef struct
+{
+  size_t num;
+  size_t cap;
+  size_t *rows;
+} find_all_t;
+
 extern void table_init (void);
-extern bool save (json_t *from, const char *to);
-extern find_ret_t find_by (json_t *tbl, find_pair_t *cnd, size_t num);
+extern bool table_checkpoint (void);
+extern bool table_bgsave (void);
+extern bool table_export (void);
+extern bool table_compact (void (*move) (table_t *tbl, size_t from,
+					 size_t to));
+
+extern void table_rdlock (void);
+extern void table_wrlock (void);
+extern void table_unlock (void);
+extern void table_row (json_out_t *out, table_t *tbl, size_t row);
+
+extern find_ret_t find_by (table_t *tbl, find_pair_t *cnd, size_t num);
+extern bool find_all (table_t *tbl, find_pair_t *cnd, size_t num,
+		      find_all_t *ret);
+extern size_t find_from (table_t *tbl, uint64_t id);
+extern bool find_id (table_t *tbl, uint64_t id, size_t *row);
+
+extern bool table_reserve (table_t *tbl, size_t cap);
+extern bool table_grow (table_t *tbl);
+extern bool table_append (table_t *tbl, const value_t *vals, size_t *row);
+extern bool table_remove (table_t *tbl, size_t index);
+extern bool table_set (table_t *tbl, size_t index, int col, value_t val);
+extern void table_get (table_t *tbl, size_t index, value_t *vals);
+extern void table_update (table_t *tbl, size_t index, const value_t *vals);
 
 #endif
@@ -0,0 +1,722 @@
+#include "uring.h"
+#include "api.h"
+#include "arena.h"
+#include "log.h"
+#include "mongoose.h"
+#include "ring.h"
+#include "table.h"
+#include "util.h"
+#include "view.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUFS 256
+#define URING_BUF_SIZE 8192
+#define URING_REQ_MAX (3 * 1024 * 1024)
+#define URING_TIMER_MAX 4
+#define URING_CONN_INIT 1024
+
+/* the low bits of user_data tell which request completed, the rest is the
+   socket it belongs to */
+enum
+{
+  OP_ACCEPT,
+  OP_RECV,
+  OP_SEND,
+  OP_CANCEL,
+  OP_WAKE,
+  OP_TICK,
+  OP_FLUSH,
+  OP_STOP,
+};
+
+#define OP_BITS 3
+#define OP_DATA(OP, FD) ((uint64_t) (FD) << OP_BITS | (OP))
+
+/* OUT is not touched while a send of it is in flight, requests that
+   arrive meanwhile wait in IN */
+typedef struct
+{
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  size_t out_off;
+
+  /* a reply held back until the log records it wrote are synced, or a
+     list going out in chunks from CURSOR */
+  uint64_t lsn;
+  int status;
+  char *content;
+  size_t len;
+  size_t off;
+  view_cursor_t *cursor;
+
+  bool used;
+  bool reading;
+  bool sending;
+  bool closing;
+  bool cancelled;
+} conn_t;
+
+typedef struct
+{
+  uint64_t due;
+  unsigned interval;
+  void (*fn) (void *);
+  void *arg;
+} tick_t;
+
+static struct
+{
+  ring_t io;
+  int listen_fd;
+  int wake_fd;
+  uint64_t wake_val;
+  struct __kernel_timespec tick;
+  struct __kernel_timespec flush;
+  bool flush_armed;
+
+  /* receive buffers the kernel picks from, registered once */
+  struct io_uring_buf_ring *br;
+  char *bufs;
+
+  conn_t *conns;
+  size_t nconn;
+
+  tick_t timers[URING_TIMER_MAX];
+  size_t ntimer;
+
+  /* completions sqe_get took off the ring to make the kernel accept
+     sqes again, they are older than whatever is still on it */
+  struct io_uring_cqe *later;
+  size_t nlater;
+  size_t later_cap;
+} ring = { .io = { .fd = -1 }, .listen_fd = -1, .wake_fd = -1 };
+
+static inline uint64_t
+now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void
+ring_flush (unsigned wait)
+{
+  if (!ring_submit (&ring.io, wait))
+    error ("io_uring 提交失败: %s", strerror (errno));
+}
+
+/* moves every completion on the ring aside, false if there was none */
+static inline bool
+cqe_defer (void)
+{
+  bool moved = false;
+
+  for (struct io_uring_cqe *cqe; (cqe = ring_peek (&ring.io));
+       ring_next (&ring.io))
+    {
+      if (ring.nlater == ring.later_cap)
+	{
+	  size_t cap = ring.later_cap ? ring.later_cap * 2 : URING_ENTRIES;
+	  struct io_uring_cqe *temp;
+	  if (!(temp = realloc (ring.later, cap * sizeof (*temp))))
+	    error ("内存不足");
+	  ring.later = temp;
+	  ring.later_cap = cap;
+	}
+
+      ring.later[ring.nlater++] = *cqe;
+      moved = true;
+    }
+
+  return moved;
+}
+
+static inline struct io_uring_sqe *
+sqe_get (uint64_t data)
+{
+  struct io_uring_sqe *sqe;
+  while (!(sqe = ring_sqe (&ring.io, data)))
+    if (errno != EBUSY || !cqe_defer ())
+      error ("io_uring 提交失败: %s", strerror (errno));
+  return sqe;
+}
+
+static inline void
+buf_put (unsigned bid)
+{
+  unsigned short tail = ring.br->tail;
+  struct io_uring_buf *buf = ring.br->bufs + (tail & (URING_BUFS - 1));
+
+  buf->addr = (uintptr_t) (ring.bufs + (size_t) bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  __atomic_store_n (&ring.br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline void
+arm_accept (void)
+{
+  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_ACCEPT, 0));
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = ring.listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static inline void
+arm_recv (int fd)
+{
+  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_RECV, fd));
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  ring.conns[fd].reading = true;
+}
+
+static inline void
+arm_wake (void)
+{
+  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_WAKE, 0));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = ring.wake_fd;
+  sqe->addr = (uintptr_t) &ring.wake_val;
+  sqe->len = sizeof (ring.wake_val);
+}
+
+static inline void
+arm_tick (void)
+{
+  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_TICK, 0));
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t) &ring.tick;
+  sqe->len = 1;
+}
+
+/* wakes the loop when the coalesced log is due */
+static inline void
+arm_flush (long ms)
+{
+  if (ring.flush_armed)
+    return;
+
+  ring.flush = (struct __kernel_timespec){ .tv_sec = ms / 1000,
+					   .tv_nsec = ms % 1000 * 1000000 };
+
+  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_FLUSH, 0));
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t) &ring.flush;
+  sqe->len = 1;
+  ring.flush_armed = true;
+}
+
+static void
+listen_on (const char *url)
+{
+  struct mg_addr addr = { .port = mg_htons (mg_url_port (url)) };
+  if (!mg_aton (mg_url_host (url), &addr))
+    error ("监听地址 %s 无效", url);
+
+  int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    error ("监听 %s 失败", url);
+
+  int on = 1;
+  struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = addr.port };
+  memcpy (&sin.sin_addr, addr.ip, sizeof (sin.sin_addr));
+
+  if (0 != setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on))
+      || 0 != bind (fd, (struct sockaddr *) &sin, sizeof (sin))
+      || 0 != listen (fd, MG_SOCK_LISTEN_BACKLOG_SIZE))
+    error ("监听 %s 失败", url);
+
+  ring.listen_fd = fd;
+}
+
+static void
+ring_bufs (void)
+{
+  ring.br = mmap (NULL, URING_BUFS * sizeof (struct io_uring_buf),
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring.bufs = mmap (NULL, (size_t) URING_BUFS * URING_BUF_SIZE,
+		    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring.br == MAP_FAILED || ring.bufs == MAP_FAILED)
+    error ("内存不足");
+
+  struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t) ring.br,
+				  .ring_entries = URING_BUFS,
+				  .bgid = 0 };
+  if (0 != syscall (__NR_io_uring_register, ring.io.fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1))
+    error ("io_uring 缓冲区注册失败: %s", strerror (errno));
+
+  ring.br->tail = 0;
+  for (unsigned i = 0; i < URING_BUFS; i++)
+    buf_put (i);
+}
+
+void
+uring_init (const char *url)
+{
+  if (!ring_init (&ring.io, URING_ENTRIES))
+    error ("io_uring 初始化失败: %s", strerror (errno));
+
+  ring_bufs ();
+  listen_on (url);
+
+  if ((ring.wake_fd = eventfd (0, EFD_CLOEXEC)) < 0)
+    error ("事件循环唤醒初始化失败");
+
+  ring.tick = (struct __kernel_timespec){ .tv_sec = 1 };
+}
+
+/* runs on the event loop between requests, like mg_timer_add, the idle
+   tick comes at least as often as the shortest timer */
+void
+uring_timer (unsigned ms, void (*fn) (void *), void *arg)
+{
+  if (ring.ntimer >= URING_TIMER_MAX)
+    error ("定时器过多");
+
+  uint64_t tick_ms = ring.tick.tv_sec * 1000 + ring.tick.tv_nsec / 1000000;
+  if (ms < tick_ms)
+    ring.tick = (struct __kernel_timespec){ .tv_sec = ms / 1000,
+					    .tv_nsec = ms % 1000 * 1000000 };
+
+  ring.timers[ring.ntimer++] = (tick_t){
+    .due = now_ms () + ms, .interval = ms, .fn = fn, .arg = arg
+  };
+}
+
+/* safe from any thread, e.g. the log thread after a group is synced */
+void
+uring_wake (void)
+{
+  uint64_t one = 1;
+  if (write (ring.wake_fd, &one, sizeof (one)) < 0)
+    return;
+}
+
+static inline void
+buf_grow (char **buf, size_t *cap, size_t need)
+{
+  if (need <= *cap)
+    return;
+
+  size_t cap2 = *cap ? *cap : 1024;
+  while (cap2 < need)
+    cap2 *= 2;
+
+  char *temp;
+  if (!(temp = realloc (*buf, cap2)))
+    error ("内存不足");
+  *buf = temp;
+  *cap = cap2;
+}
+
+static inline void
+conn_open (int fd)
+{
+  if ((size_t) fd >= ring.nconn)
+    {
+      size_t num = ring.nconn ? ring.nconn : URING_CONN_INIT;
+      while (num <= (size_t) fd)
+	num *= 2;
+
+      conn_t *temp;
+      if (!(temp = realloc (ring.conns, num * sizeof (conn_t))))
+	error ("内存不足");
+      memset (temp + ring.nconn, 0, (num - ring.nconn) * sizeof (conn_t));
+      ring.conns = temp;
+      ring.nconn = num;
+    }
+
+  ring.conns[fd] = (conn_t){ .used = true };
+  arm_recv (fd);
+}
+
+/* the socket is closed once no request on it is in flight, a multishot
+   receive still armed is cancelled first */
+static inline void
+conn_check (int fd)
+{
+  conn_t *c = ring.conns + fd;
+  if (!c->closing)
+    return;
+
+  if (c->reading)
+    {
+      if (!c->cancelled)
+	{
+	  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_CANCEL, fd));
+	  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	  sqe->addr = OP_DATA (OP_RECV, fd);
+	  c->cancelled = true;
+	}
+      return;
+    }
+
+  if (c->sending)
+    return;
+
+  close (fd);
+  free (c->in);
+  free (c->out);
+  if (c->lsn)
+    free (c->content);
+  else if (c->cursor)
+    view_close (c->cursor);
+  *c = (conn_t){ 0 };
+}
+
+/* keeps a chunk ahead of the socket */
+static inline void
+conn_pump (conn_t *c)
+{
+  while (c->cursor && c->out_len - c->out_off < API_CHUNK)
+    {
+      buf_grow (&c->out, &c->out_cap, c->out_len + API_STREAM_STEP);
+      char *end = api_stream (c->out + c->out_len, c->cursor, &c->off);
+      if (!end)
+	{
+	  c->closing = true;
+	  return;
+	}
+      c->out_len = end - c->out;
+
+      if (api_stream_done (c->off))
+	{
+	  view_close (c->cursor);
+	  c->cursor = NULL;
+	}
+    }
+}
+
+/* same bytes as reply in main.c */
+static inline void
+conn_reply (conn_t *c, api_ret ret)
+{
+  if (api_streamed (&ret))
+    {
+      c->cursor = ret.cursor;
+      c->off = 0;
+      conn_pump (c);
+      return;
+    }
+
+  size_t size = api_reply_size (&ret);
+
+  buf_grow (&c->out, &c->out_cap, c->out_len + size);
+  api_reply (c->out + c->out_len, &ret);
+  c->out_len += size;
+}
+
+static inline void
+conn_flush (int fd)
+{
+  conn_t *c = ring.conns + fd;
+  if (c->sending || c->closing || c->out_off >= c->out_len)
+    return;
+
+  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_SEND, fd));
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) (c->out + c->out_off);
+  sqe->len = c->out_len - c->out_off;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  c->sending = true;
+}
+
+static inline void
+conn_handle (conn_t *c, struct mg_http_message *msg, bool fast)
+{
+  bool readonly = api_readonly (msg);
+  readonly ? table_rdlock () : table_wrlock ();
+
+  uint64_t lsn = log_lsn ();
+  api_ret ret = api_handle (msg);
+  uint64_t end = log_lsn ();
+
+  table_unlock ();
+
+  if (fast || end == lsn || log_synced () >= end)
+    conn_reply (c, ret);
+  else
+    {
+      if (!(c->content = strdup (ret.content)))
+	error ("内存不足");
+      c->lsn = end;
+      c->status = ret.status;
+      c->len = ret.len;
+    }
+
+  arena_reset ();
+}
+
+/* runs every whole request buffered so far, replies of pipelined
+   requests are sent together */
+static void
+conn_serve (int fd, bool fast)
+{
+  conn_t *c = ring.conns + fd;
+  conn_pump (c);
+
+  while (!c->sending && !c->closing && !c->lsn && !c->cursor && c->in_len)
+    {
+      struct mg_http_message msg;
+      int n = mg_http_parse (c->in, c->in_len, &msg);
+
+      if (n < 0 || (!n && c->in_len > URING_REQ_MAX)
+	  || (n > 0 && msg.message.len > URING_REQ_MAX))
+	{
+	  c->closing = true;
+	  break;
+	}
+
+      if (!n || c->in_len < msg.message.len)
+	break;
+
+      size_t len = msg.message.len;
+      conn_handle (c, &msg, fast);
+
+      memmove (c->in, c->in + len, c->in_len - len);
+      c->in_len -= len;
+    }
+
+  conn_flush (fd);
+  conn_check (fd);
+}
+
+static inline void
+on_recv (int fd, struct io_uring_cqe *cqe, bool fast)
+{
+  conn_t *c = ring.conns + fd;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+      unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (cqe->res > 0 && !c->closing)
+	{
+	  buf_grow (&c->in, &c->in_cap, c->in_len + cqe->res);
+	  memcpy (c->in + c->in_len,
+		  ring.bufs + (size_t) bid * URING_BUF_SIZE, cqe->res);
+	  c->in_len += cqe->res;
+	}
+      buf_put (bid);
+    }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    c->reading = false;
+
+  /* out of buffers, they are handed back right after the copy so the
+     receive is simply rearmed */
+  if (cqe->res <= 0 && cqe->res != -ENOBUFS)
+    c->closing = true;
+
+  if (c->closing)
+    {
+      conn_check (fd);
+      return;
+    }
+
+  if (!c->reading && !c->closing)
+    arm_recv (fd);
+  conn_serve (fd, fast);
+}
+
+static inline void
+on_send (int fd, struct io_uring_cqe *cqe, bool fast)
+{
+  conn_t *c = ring.conns + fd;
+  c->sending = false;
+
+  if (cqe->res < 0)
+    {
+      c->closing = true;
+      conn_check (fd);
+      return;
+    }
+
+  c->out_off += cqe->res;
+  if (c->out_off >= c->out_len)
+    c->out_off = c->out_len = 0;
+
+  conn_serve (fd, fast);
+}
+
+/* the log thread synced another group, release the replies waiting on
+   it */
+static void
+on_wake (bool fast)
+{
+  uint64_t synced = log_synced ();
+
+  for (size_t fd = 0; fd < ring.nconn; fd++)
+    {
+      conn_t *c = ring.conns + fd;
+      if (!c->used || !c->lsn || synced < c->lsn)
+	continue;
+
+      conn_reply (c, (api_ret){ .status = c->status,
+				.content = c->content,
+				.len = c->len });
+      free (c->content);
+      c->lsn = 0;
+      conn_serve (fd, fast);
+    }
+}
+
+static inline void
+on_cqe (struct io_uring_cqe *cqe, bool fast)
+{
+  int op = cqe->user_data & ((1 << OP_BITS) - 1);
+  int fd = cqe->user_data >> OP_BITS;
+
+  switch (op)
+    {
+    case OP_ACCEPT:
+      if (cqe->res >= 0)
+	conn_open (cqe->res);
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+	arm_accept ();
+      break;
+    case OP_RECV:
+      on_recv (fd, cqe, fast);
+      break;
+    case OP_SEND:
+      on_send (fd, cqe, fast);
+      break;
+    case OP_WAKE:
+      on_wake (fast);
+      arm_wake ();
+      break;
+    case OP_TICK:
+      arm_tick ();
+      break;
+    case OP_FLUSH:
+      ring.flush_armed = false;
+      break;
+    }
+}
+
+static inline void
+run_timers (void)
+{
+  uint64_t now = now_ms ();
+  for (size_t i = 0; i < ring.ntimer; i++)
+    if (now >= ring.timers[i].due)
+      {
+	ring.timers[i].fn (ring.timers[i].arg);
+	ring.timers[i].due = now + ring.timers[i].interval;
+      }
+}
+
+/* the ones moved aside first, handling one may move more */
+static inline void
+reap (bool fast)
+{
+  while (ring.nlater || ring_peek (&ring.io))
+    {
+      for (size_t i = 0; i < ring.nlater; i++)
+	{
+	  struct io_uring_cqe copy = ring.later[i];
+	  on_cqe (&copy, fast);
+	}
+      ring.nlater = 0;
+
+      struct io_uring_cqe *cqe;
+      while (!ring.nlater && (cqe = ring_peek (&ring.io)))
+	{
+	  struct io_uring_cqe copy = *cqe;
+	  ring_next (&ring.io);
+	  on_cqe (&copy, fast);
+	}
+    }
+}
+
+/* completions are handled in batches, the requests they queue go out
+   with the next wait, so one syscall serves many connections */
+void
+uring_run (volatile sig_atomic_t *stop, bool fast)
+{
+  arm_accept ();
+  arm_wake ();
+  arm_tick ();
+
+  while (!*stop)
+    {
+      ring_flush (1);
+      reap (fast);
+      run_timers ();
+
+      long wait = log_poll ();
+      if (!wait)
+	on_wake (fast);
+      else if (wait > 0)
+	arm_flush (wait);
+    }
+
+  arena_release ();
+}
+
+/* the ring is torn down asynchronously, requests still armed would keep
+   the listener bound for a while after exit */
+static void
+ring_cancel (void)
+{
+  struct io_uring_sqe *sqe = sqe_get (OP_DATA (OP_STOP, 0));
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+
+  for (bool done = false; !done;)
+    {
+      ring_flush (1);
+
+      for (struct io_uring_cqe *cqe; (cqe = ring_peek (&ring.io));
+	   ring_next (&ring.io))
+	if (cqe->user_data == OP_DATA (OP_STOP, 0))
+	  done = true;
+    }
+}
+
+/* replies still waiting for the log are dropped with their sockets */
+void
+uring_free (void)
+{
+  ring_cancel ();
+
+  for (size_t fd = 0; fd < ring.nconn; fd++)
+    {
+      conn_t *c = ring.conns + fd;
+      if (!c->used)
+	continue;
+
+      close (fd);
+      free (c->in);
+      free (c->out);
+      if (c->lsn)
+	free (c->content);
+    }
+
+  free (ring.conns);
+  free (ring.later);
+  close (ring.listen_fd);
+  close (ring.wake_fd);
+  ring_free (&ring.io);
+}
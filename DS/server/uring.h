@@ -0,0 +1,13 @@
+#ifndef URING_H
+#define URING_H
+
+#include <signal.h>
+#include <stdbool.h>
+
+extern void uring_init (const char *url);
+extern void uring_timer (unsigned ms, void (*fn) (void *), void *arg);
+extern void uring_run (volatile sig_atomic_t *stop, bool fast);
+extern void uring_wake (void);
+extern void uring_free (void);
+
+#endif
@@ -0,0 +1,535 @@
+#include "view.h"
+#include "arena.h"
+#include "cache.h"
+#include "json.h"
+#include "table.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* rendered every row once with the merchant or student columns the list
+   endpoints join in, so a list is only copied together */
+frag_t *view_menu;
+frag_t *view_eva;
+
+static size_t menu_cap;
+static size_t eva_cap;
+
+/* view_build resets the arena this often, it runs between requests */
+#define VIEW_BATCH 1024
+
+static inline bool
+view_reserve (frag_t **frags, size_t *cap, size_t num)
+{
+  if (num <= *cap)
+    return true;
+
+  size_t ncap = *cap ? *cap : 64;
+  while (ncap < num)
+    ncap *= 2;
+
+  frag_t *temp;
+  if (!(temp = realloc (*frags, ncap * sizeof (frag_t))))
+    return false;
+
+  memset (temp + *cap, 0, (ncap - *cap) * sizeof (frag_t));
+  *frags = temp;
+  *cap = ncap;
+  return true;
+}
+
+static inline void
+frag_clear (frag_t *frag)
+{
+  free (frag->str);
+  *frag = (frag_t){ .str = NULL };
+}
+
+/* OUT holds the finished element, copied out of the arena */
+static inline bool
+frag_set (frag_t *frag, json_out_t *out)
+{
+  size_t len;
+  char *str = json_out_done (out, &len);
+  if (!str)
+    return false;
+
+  char *copy;
+  if (!(copy = malloc (len + 1)))
+    return false;
+
+  memcpy (copy, str, len + 1);
+  free (frag->str);
+  *frag = (frag_t){ .str = copy, .len = len };
+  return true;
+}
+
+static inline void
+out_str (json_out_t *out, const char *key, const char *str)
+{
+  json_out_key (out, key);
+  json_out_str (out, str, strlen (str));
+}
+
+/* the dish with merchant row MROW, none when it is the table size */
+static inline bool
+menu_render (size_t row, size_t mrow)
+{
+  if (!view_reserve (&view_menu, &menu_cap, row + 1))
+    return false;
+
+  frag_t *frag = view_menu + row;
+  table_t *mer = table_merchant;
+
+  if (mrow >= mer->num)
+    {
+      frag_clear (frag);
+      return true;
+    }
+
+  json_out_t *out;
+  if (!(out = json_out_new ()))
+    return false;
+
+  json_out_obj (out);
+  table_row (out, table_menu, row);
+  out_str (out, "uname", COL_STR (mer, MERCHANT_NAME, mrow));
+  out_str (out, "position", COL_STR (mer, MERCHANT_POSITION, mrow));
+  json_out_end (out);
+
+  return frag_set (frag, out);
+}
+
+/* the evaluation with student row SROW, none when it is the table size */
+static inline bool
+eva_render (size_t row, size_t srow)
+{
+  if (!view_reserve (&view_eva, &eva_cap, row + 1))
+    return false;
+
+  frag_t *frag = view_eva + row;
+  table_t *tbl = table_evaluation, *stu = table_student;
+
+  if (srow >= stu->num)
+    {
+      frag_clear (frag);
+      return true;
+    }
+
+  json_out_t *out;
+  if (!(out = json_out_new ()))
+    return false;
+
+  json_out_obj (out);
+  json_out_key (out, "id");
+  json_out_int (out, COL_INT (tbl, EVA_ID, row));
+  out_str (out, "user", COL_STR (tbl, EVA_USER, row));
+  out_str (out, "uname", COL_STR (stu, STUDENT_NAME, srow));
+  json_out_key (out, "grade");
+  json_out_num (out, COL_NUM (tbl, EVA_GRADE, row));
+  out_str (out, "evaluation", COL_STR (tbl, EVA_EVALUATION, row));
+  json_out_end (out);
+
+  return frag_set (frag, out);
+}
+
+/* the row of TBL whose COL is VAL, or the table size */
+static inline size_t
+owner (table_t *tbl, int col, const char *val)
+{
+  find_pair_t cnd[] = { { .col = col, .val.sval = val } };
+  find_ret_t find = find_by (tbl, cnd, 1);
+  return find.found ? find.index : tbl->num;
+}
+
+/* renders every row of TBL whose COL is USER again against OWNER, and
+   drops the cached lists that showed them */
+static inline bool
+rerender (table_t *tbl, int col, const char *user, size_t own,
+	  bool (*render) (size_t, size_t))
+{
+  find_pair_t cnd[] = { { .col = col, .val.sval = user } };
+  find_all_t all;
+
+  if (!find_all (tbl, cnd, 1, &all))
+    return false;
+
+  bool ok = true;
+  for (size_t i = 0; ok && i < all.num; i++)
+    {
+      ok = render (all.rows[i], own);
+      if (tbl == table_evaluation)
+	cache_eva_drop (COL_INT (tbl, EVA_ID, all.rows[i]));
+    }
+
+  if (tbl == table_menu && all.num)
+    cache_menu_drop ();
+
+  free (all.rows);
+  return ok;
+}
+
+static inline void
+build (table_t *tbl, frag_t **frags, size_t *cap, int col, table_t *of,
+       int key, bool (*render) (size_t, size_t))
+{
+  if (!view_reserve (frags, cap, tbl->num))
+    error ("内存不足");
+
+  for (size_t i = 0; i < *cap; i++)
+    {
+      if (i >= tbl->num || !ROW_LIVE (tbl, i))
+	frag_clear (*frags + i);
+      else if (!render (i, owner (of, key, COL_STR (tbl, col, i))))
+	error ("内存不足");
+
+      if (i % VIEW_BATCH == VIEW_BATCH - 1)
+	arena_reset ();
+    }
+
+  arena_reset ();
+}
+
+/* from scratch, after the tables are loaded */
+void
+view_build (void)
+{
+  build (table_menu, &view_menu, &menu_cap, MENU_USER, table_merchant,
+	 MERCHANT_USER, menu_render);
+  build (table_evaluation, &view_eva, &eva_cap, EVA_USER, table_student,
+	 STUDENT_USER, eva_render);
+}
+
+/* a compaction moved the row at FROM of TBL down to TO, the fragment
+   goes along with it */
+void
+view_move (table_t *tbl, size_t from, size_t to)
+{
+  frag_t *frags;
+  size_t cap;
+
+  if (tbl == table_menu)
+    frags = view_menu, cap = menu_cap;
+  else if (tbl == table_evaluation)
+    frags = view_eva, cap = eva_cap;
+  else
+    return;
+
+  if (from >= cap)
+    return;
+
+  free (frags[to].str);
+  frags[to] = frags[from];
+  frags[from] = (frag_t){ .str = NULL };
+}
+
+/* the changes below follow a log record that is already written, so
+   there is no going back from a failure, and the log rebuilds the views
+   on the next start */
+
+/* menu row ROW was added or changed */
+void
+view_menu_put (size_t row)
+{
+  const char *user = COL_STR (table_menu, MENU_USER, row);
+  if (!menu_render (row, owner (table_merchant, MERCHANT_USER, user)))
+    error ("内存不足");
+}
+
+void
+view_menu_del (size_t row)
+{
+  if (row < menu_cap)
+    frag_clear (view_menu + row);
+}
+
+/* merchant row ROW was added or changed its name or position */
+void
+view_merchant_put (size_t row)
+{
+  if (!rerender (table_menu, MENU_USER,
+		 COL_STR (table_merchant, MERCHANT_USER, row), row,
+		 menu_render))
+    error ("内存不足");
+}
+
+/* merchant row ROW is about to be removed */
+void
+view_merchant_del (size_t row)
+{
+  if (!rerender (table_menu, MENU_USER,
+		 COL_STR (table_merchant, MERCHANT_USER, row),
+		 table_merchant->num, menu_render))
+    error ("内存不足");
+}
+
+/* evaluation row ROW was added or changed */
+void
+view_eva_put (size_t row)
+{
+  const char *user = COL_STR (table_evaluation, EVA_USER, row);
+  if (!eva_render (row, owner (table_student, STUDENT_USER, user)))
+    error ("内存不足");
+}
+
+void
+view_eva_del (size_t row)
+{
+  if (row < eva_cap)
+    frag_clear (view_eva + row);
+}
+
+/* student row ROW was added or changed its name */
+void
+view_student_put (size_t row)
+{
+  if (!rerender (table_evaluation, EVA_USER,
+		 COL_STR (table_student, STUDENT_USER, row), row,
+		 eva_render))
+    error ("内存不足");
+}
+
+/* student row ROW is about to be removed */
+void
+view_student_del (size_t row)
+{
+  if (!rerender (table_evaluation, EVA_USER,
+		 COL_STR (table_student, STUDENT_USER, row),
+		 table_student->num, eva_render))
+    error ("内存不足");
+}
+
+/* the size of the json array of FRAGS at ROWS, or at every live row of
+   TBL when ROWS is NULL; false if one shows a missing account */
+bool
+view_size (table_t *tbl, const frag_t *frags, const size_t *rows,
+	   size_t num, size_t *size)
+{
+  *size = 2;
+  for (size_t i = 0; i < num; i++)
+    {
+      size_t row = rows ? rows[i] : i;
+      if (!rows && !ROW_LIVE (tbl, row))
+	continue;
+      if (!frags[row].str)
+	return false;
+      *size += frags[row].len + 2;
+    }
+  return true;
+}
+
+/* the array itself in the request arena, SIZE from view_size */
+char *
+view_list (table_t *tbl, const frag_t *frags, const size_t *rows,
+	   size_t num, size_t size, size_t *len)
+{
+  char *str, *pos;
+  if (!(str = pos = arena_alloc (size + 1)))
+    return NULL;
+
+  *pos++ = '[';
+  for (size_t i = 0; i < num; i++)
+    {
+      size_t row = rows ? rows[i] : i;
+      if (!rows && !ROW_LIVE (tbl, row))
+	continue;
+
+      if (pos != str + 1)
+	{
+	  memcpy (pos, ", ", 2);
+	  pos += 2;
+	}
+      memcpy (pos, frags[row].str, frags[row].len);
+      pos += frags[row].len;
+    }
+
+  *pos++ = ']';
+  *pos = '\0';
+  *len = pos - str;
+  return str;
+}
+
+/* a list given out a piece at a time, it holds the ids of its rows,
+   not their slots, which a compaction may change between two pieces;
+   rows added after view_open are not part of it */
+struct view_cursor
+{
+  table_t *tbl;
+  uint64_t last;
+
+  /* the rows of an evaluation list, POS of them done, or NULL for every
+     row of the table, NEXT the id the rest starts at */
+  uint64_t *ids;
+  size_t num;
+  size_t pos;
+  uint64_t next;
+
+  bool begun;
+  bool sep;
+  bool done;
+
+  /* an element that did not fit in the last piece, PEND_OFF of it given
+     out, copied so that a change to its row cannot tear it */
+  char *pend;
+  size_t pend_len;
+  size_t pend_off;
+  size_t pend_cap;
+};
+
+/* over the menu when ROWS is NULL, or over the evaluations at ROWS */
+view_cursor_t *
+view_open (table_t *tbl, const size_t *rows, size_t num)
+{
+  view_cursor_t *cur;
+  if (!(cur = calloc (1, sizeof (view_cursor_t))))
+    return NULL;
+
+  cur->tbl = tbl;
+  cur->last = tbl->last_id;
+
+  if (rows)
+    {
+      if (!(cur->ids = malloc ((num ? num : 1) * sizeof (uint64_t))))
+	{
+	  free (cur);
+	  return NULL;
+	}
+
+      for (size_t i = 0; i < num; i++)
+	cur->ids[i] = ROW_ID (tbl, rows[i]);
+      cur->num = num;
+    }
+
+  return cur;
+}
+
+void
+view_close (view_cursor_t *cur)
+{
+  free (cur->ids);
+  free (cur->pend);
+  free (cur);
+}
+
+/* the fragment of the next row that is still there, *SLOT is where the
+   walk over the whole table goes on */
+static inline const frag_t *
+cursor_frag (view_cursor_t *cur, size_t *slot)
+{
+  table_t *tbl = cur->tbl;
+  const frag_t *frags = tbl == table_menu ? view_menu : view_eva;
+  size_t cap = tbl == table_menu ? menu_cap : eva_cap;
+
+  for (;;)
+    {
+      size_t row;
+      if (cur->ids)
+	{
+	  if (cur->pos == cur->num)
+	    return NULL;
+	  if (!find_id (tbl, cur->ids[cur->pos++], &row))
+	    continue;
+	}
+      else
+	{
+	  if ((row = (*slot)++) >= tbl->num)
+	    return NULL;
+	  if (!ROW_LIVE (tbl, row))
+	    continue;
+	  if (ROW_ID (tbl, row) > cur->last)
+	    return NULL;
+	  cur->next = ROW_ID (tbl, row) + 1;
+	}
+
+      /* a row whose account went away meanwhile is left out */
+      if (row < cap && frags[row].str)
+	return frags + row;
+    }
+}
+
+static inline bool
+cursor_keep (view_cursor_t *cur, const frag_t *frag)
+{
+  size_t len = (cur->sep ? 2 : 0) + frag->len;
+  if (len > cur->pend_cap)
+    {
+      char *temp;
+      if (!(temp = realloc (cur->pend, len)))
+	return false;
+      cur->pend = temp;
+      cur->pend_cap = len;
+    }
+
+  char *pos = cur->pend;
+  if (cur->sep)
+    pos = memcpy (pos, ", ", 2) + 2;
+  memcpy (pos, frag->str, frag->len);
+
+  cur->pend_len = len;
+  cur->pend_off = 0;
+  return true;
+}
+
+/* the next at most CAP bytes of the list to DST, returns their end, or
+   NULL if out of memory; the slots are only looked at under the table
+   read lock, which it takes itself */
+char *
+view_next (view_cursor_t *cur, char *dst, size_t cap)
+{
+  char *end = dst + cap;
+  bool ok = true;
+
+  table_rdlock ();
+  size_t slot = cur->ids ? 0 : find_from (cur->tbl, cur->next);
+
+  while (ok && !cur->done && dst < end)
+    {
+      if (cur->pend_off < cur->pend_len)
+	{
+	  size_t num = cur->pend_len - cur->pend_off;
+	  if (num > (size_t) (end - dst))
+	    num = end - dst;
+
+	  memcpy (dst, cur->pend + cur->pend_off, num);
+	  dst += num;
+	  cur->pend_off += num;
+	  continue;
+	}
+
+      if (!cur->begun)
+	{
+	  *dst++ = '[';
+	  cur->begun = true;
+	  continue;
+	}
+
+      const frag_t *frag;
+      if (!(frag = cursor_frag (cur, &slot)))
+	{
+	  *dst++ = ']';
+	  cur->done = true;
+	  break;
+	}
+
+      size_t len = (cur->sep ? 2 : 0) + frag->len;
+      if (len > (size_t) (end - dst))
+	ok = cursor_keep (cur, frag);
+      else
+	{
+	  if (cur->sep)
+	    dst = memcpy (dst, ", ", 2) + 2;
+	  dst = memcpy (dst, frag->str, frag->len) + frag->len;
+	}
+      cur->sep = true;
+    }
+
+  table_unlock ();
+  return ok ? dst : NULL;
+}
+
+/* every byte of the list given out */
+bool
+view_done (const view_cursor_t *cur)
+{
+  return cur->done;
+}
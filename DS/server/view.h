@@ -0,0 +1,46 @@
+#ifndef VIEW_H
+#define VIEW_H
+
+#include "table.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* one list element already rendered as json, STR is NULL while the row
+   is dead or the account it shows is gone */
+typedef struct
+{
+  char *str;
+  size_t len;
+} frag_t;
+
+/* indexed by menu and evaluation row */
+extern frag_t *view_menu;
+extern frag_t *view_eva;
+
+extern void view_build (void);
+extern void view_move (table_t *tbl, size_t from, size_t to);
+
+extern void view_menu_put (size_t row);
+extern void view_menu_del (size_t row);
+extern void view_merchant_put (size_t row);
+extern void view_merchant_del (size_t row);
+
+extern void view_eva_put (size_t row);
+extern void view_eva_del (size_t row);
+extern void view_student_put (size_t row);
+extern void view_student_del (size_t row);
+
+extern bool view_size (table_t *tbl, const frag_t *frags, const size_t *rows,
+		       size_t num, size_t *size);
+extern char *view_list (table_t *tbl, const frag_t *frags, const size_t *rows,
+			size_t num, size_t size, size_t *len);
+
+typedef struct view_cursor view_cursor_t;
+
+extern view_cursor_t *view_open (table_t *tbl, const size_t *rows,
+				 size_t num);
+extern char *view_next (view_cursor_t *cur, char *dst, size_t cap);
+extern bool view_done (const view_cursor_t *cur);
+extern void view_close (view_cursor_t *cur);
+
+#endif